@@ -0,0 +1,683 @@
+/*
+*  pm_bench.c / Assignment: Practicum 1
+*
+*  James Florez and John Ciolfi / CS5600 / Northeastern University
+*  Spring 2023 / Mar 17, 2023
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "pm_heap.h"
+
+// page size used by the benchmarks.
+#define BENCH_PAGE_SIZE 64
+// number of timed passes over every allocation per run.
+#define BENCH_ROUNDS 2
+// most threads used by the scaling benchmarks.
+#define BENCH_MAX_THREADS 32
+// allocations each thread keeps live in the scaling benchmarks.
+#define BENCH_THREAD_ALLOCS 64
+// allocations per batch of the thread caches, when the scaling benchmark uses them.
+#define BENCH_THREAD_CACHE 16
+// operations each thread performs in the scaling benchmarks.
+#define BENCH_THREAD_OPS 200000
+// allocations shared by every thread in the read-mostly benchmark.
+#define BENCH_SHARED_ALLOCS 1024
+// percentage of operations that are reads in the read-mostly benchmark.
+#define BENCH_READ_PERCENT 95
+
+// each power of two of latency is split into this many histogram buckets (as a power of two).
+#define BENCH_HIST_SUB_BITS 4
+// number of latency histogram buckets, enough for any 64-bit latency in nanoseconds.
+#define BENCH_HIST_BUCKETS (64 << BENCH_HIST_SUB_BITS)
+// number of phases of the working set shift workload. The hot set moves at the start of each.
+#define BENCH_SHIFT_PHASES 4
+
+// allocations shared by every thread in the read-mostly benchmark.
+page_t* bench_shared[BENCH_SHARED_ALLOCS];
+
+// access patterns of the workload benchmark.
+enum bench_pattern {
+    // every allocation is equally likely.
+    BENCH_UNIFORM,
+    // allocation ranks follow a Zipfian distribution, scattered over the allocations.
+    BENCH_ZIPF,
+    // each thread walks the allocations in order, starting at its own offset.
+    BENCH_SCAN,
+    // uniform over a hot set half the size of memory, which moves to new allocations every phase.
+    BENCH_SHIFT,
+    BENCH_PATTERNS
+};
+const char* bench_pattern_names[BENCH_PATTERNS] = { "uniform", "zipf", "scan", "shift" };
+const char* bench_policy_names[] = { "lru", "clock", "2q", "arc" };
+
+// options of the workload benchmark, set with key=value arguments.
+struct bench_options {
+    // pattern to run, or BENCH_PATTERNS to run all of them.
+    int pattern;
+    int threads;
+    unsigned long ops;
+    int read_percent;
+    unsigned long page_size;
+    unsigned long heap_pages;
+    unsigned long disk_pages;
+    unsigned int shards;
+    pm_policy_t policy;
+    bool flusher;
+    unsigned long zpool_bytes;
+    bool swap_mmap;
+    bool dedup;
+    unsigned int readahead;
+    unsigned int evict_batch;
+    double zipf_theta;
+};
+typedef struct bench_options bench_options_t;
+
+// latency histogram with buckets of roughly equal relative width.
+struct bench_hist {
+    uint64_t counts[BENCH_HIST_BUCKETS];
+    uint64_t total;
+};
+typedef struct bench_hist bench_hist_t;
+
+// state of one workload thread.
+struct bench_worker {
+    const bench_options_t* options;
+    page_t** ptrs;
+    unsigned long allocs;
+    int id;
+    unsigned int seed;
+    // Zipfian constants (see bench_zipf_next).
+    double zipf_zetan;
+    double zipf_alpha;
+    double zipf_eta;
+    bench_hist_t hist;
+};
+typedef struct bench_worker bench_worker_t;
+
+/**
+ * Current time in nanoseconds from a monotonic clock.
+ *
+ * @return the time in nanoseconds.
+ */
+double bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Measure the average latency of a miss with the given number of allocations. Half of the
+ * allocations fit in memory, and they are accessed round robin so that every access misses
+ * and evicts the least recently used page.
+ *
+ * @param allocs the number of allocations to make.
+ * @return the average latency of a miss in nanoseconds, or a negative value on failure.
+ */
+double bench_miss_latency(unsigned long allocs) {
+    pm_config_t config = { .page_size = BENCH_PAGE_SIZE, .heap_pages = allocs / 2, .disk_pages = allocs - allocs / 2 };
+    if (!pm_init_config(&config)) {
+        return -1;
+    }
+
+    page_t** ptrs = malloc(allocs * sizeof(page_t*));
+    for (unsigned long i = 0; i < allocs; i++) {
+        ptrs[i] = pm_malloc(BENCH_PAGE_SIZE, NULL);
+    }
+
+    // first pass puts every page on disk and warms up the miss path.
+    for (unsigned long i = 0; i < allocs; i++) {
+        pm_put(ptrs[i], 0, (char) i, NULL);
+    }
+
+    unsigned long misses = BENCH_ROUNDS * allocs;
+    double start = bench_now_ns();
+    for (unsigned long i = 0; i < misses; i++) {
+        pm_access(ptrs[i % allocs], 0, NULL);
+    }
+    double elapsed = bench_now_ns() - start;
+
+    for (unsigned long i = 0; i < allocs; i++) {
+        pm_free(ptrs[i], NULL);
+    }
+    free(ptrs);
+    pm_cleanup(false);
+
+    return elapsed / misses;
+}
+
+/**
+ * Thread for the scaling benchmark: repeatedly frees and reallocates one of its allocations, then
+ * writes and reads it, so every operation contends on the heap's locks but never on its own data.
+ *
+ * @param data unused.
+ * @return NULL always.
+ */
+void* bench_scaling_thread(void* data) {
+    (void) data;
+    page_t* ptrs[BENCH_THREAD_ALLOCS];
+    for (int i = 0; i < BENCH_THREAD_ALLOCS; i++) {
+        ptrs[i] = pm_malloc(BENCH_PAGE_SIZE, NULL);
+    }
+
+    for (int op = 0; op < BENCH_THREAD_OPS; op += 4) {
+        int i = op % BENCH_THREAD_ALLOCS;
+        pm_free(ptrs[i], NULL);
+        ptrs[i] = pm_malloc(BENCH_PAGE_SIZE, NULL);
+        pm_put(ptrs[i], 0, (char) op, NULL);
+        pm_access(ptrs[i], 0, NULL);
+    }
+
+    for (int i = 0; i < BENCH_THREAD_ALLOCS; i++) {
+        pm_free(ptrs[i], NULL);
+    }
+
+    return NULL;
+}
+
+/**
+ * Measure the throughput of pm_malloc / pm_free / pm_put / pm_access with the given number of threads.
+ * Every allocation fits in memory, so nothing is paged out.
+ *
+ * @param threads the number of threads.
+ * @param shards the number of shards to split the heap into.
+ * @param cache the batch size of the thread caches, or 0 for none.
+ * @return the number of operations per second, or a negative value on failure.
+ */
+double bench_scaling(int threads, unsigned int shards, unsigned int cache) {
+    // the caches hold up to three batches per thread, which also need room in memory to be freed.
+    unsigned long allocs = threads * BENCH_THREAD_ALLOCS;
+    pm_config_t config = {
+        .page_size = BENCH_PAGE_SIZE, .heap_pages = allocs + threads * cache, .disk_pages = threads * 2 * cache,
+        .shards = shards, .thread_cache = cache
+    };
+    if (!pm_init_config(&config)) {
+        return -1;
+    }
+
+    pthread_t workers[BENCH_MAX_THREADS];
+    double start = bench_now_ns();
+    for (int t = 0; t < threads; t++) {
+        pthread_create(&workers[t], NULL, bench_scaling_thread, NULL);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    double elapsed = bench_now_ns() - start;
+
+    pm_cleanup(false);
+    return (double) threads * BENCH_THREAD_OPS / (elapsed / 1e9);
+}
+
+/**
+ * Thread for the read-mostly benchmark: reads (and occasionally writes) random shared allocations
+ * that are all in memory.
+ *
+ * @param data the seed for this thread's random numbers.
+ * @return NULL always.
+ */
+void* bench_readers_thread(void* data) {
+    unsigned int seed = *((unsigned int*) data);
+    for (int op = 0; op < BENCH_THREAD_OPS; op++) {
+        page_t* ptr = bench_shared[rand_r(&seed) % BENCH_SHARED_ALLOCS];
+        if (rand_r(&seed) % 100 < BENCH_READ_PERCENT) {
+            pm_access(ptr, op % BENCH_PAGE_SIZE, NULL);
+        } else {
+            pm_put(ptr, op % BENCH_PAGE_SIZE, (char) op, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Measure the throughput of a read-mostly mix of pm_access / pm_put on allocations shared by every thread.
+ * Every allocation fits in memory, so reads take the lockless path.
+ *
+ * @param threads the number of threads.
+ * @return the number of operations per second, or a negative value on failure.
+ */
+double bench_readers(int threads) {
+    pm_config_t config = { .page_size = BENCH_PAGE_SIZE, .heap_pages = BENCH_SHARED_ALLOCS };
+    if (!pm_init_config(&config)) {
+        return -1;
+    }
+    for (int i = 0; i < BENCH_SHARED_ALLOCS; i++) {
+        bench_shared[i] = pm_malloc(BENCH_PAGE_SIZE, NULL);
+    }
+
+    pthread_t workers[BENCH_MAX_THREADS];
+    unsigned int seeds[BENCH_MAX_THREADS];
+    double start = bench_now_ns();
+    for (int t = 0; t < threads; t++) {
+        seeds[t] = t + 1;
+        pthread_create(&workers[t], NULL, bench_readers_thread, &seeds[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    double elapsed = bench_now_ns() - start;
+
+    for (int i = 0; i < BENCH_SHARED_ALLOCS; i++) {
+        pm_free(bench_shared[i], NULL);
+    }
+    pm_cleanup(false);
+    return (double) threads * BENCH_THREAD_OPS / (elapsed / 1e9);
+}
+
+/**
+ * Histogram bucket of a latency. The bucket's top bits are the position of the highest set bit, and
+ * its low bits the next BENCH_HIST_SUB_BITS bits of the latency.
+ *
+ * @param ns the latency in nanoseconds.
+ * @return the index of the bucket.
+ */
+int bench_hist_bucket(uint64_t ns) {
+    if (ns < (1 << BENCH_HIST_SUB_BITS)) {
+        return (int) ns;
+    }
+    int top = 63 - __builtin_clzll(ns);
+    int shift = top - BENCH_HIST_SUB_BITS;
+    return ((shift + 1) << BENCH_HIST_SUB_BITS) + (int) ((ns >> shift) & ((1 << BENCH_HIST_SUB_BITS) - 1));
+}
+
+/**
+ * Largest latency that falls in a histogram bucket.
+ *
+ * @param bucket the index of the bucket.
+ * @return the latency in nanoseconds.
+ */
+uint64_t bench_hist_upper(int bucket) {
+    if (bucket < (1 << BENCH_HIST_SUB_BITS)) {
+        return bucket;
+    }
+    int shift = (bucket >> BENCH_HIST_SUB_BITS) - 1;
+    uint64_t mantissa = (1 << BENCH_HIST_SUB_BITS) | (bucket & ((1 << BENCH_HIST_SUB_BITS) - 1));
+    return ((mantissa + 1) << shift) - 1;
+}
+
+/**
+ * Latency at a percentile of a histogram, rounded up to the end of its bucket.
+ *
+ * @param hist the histogram.
+ * @param percentile the percentile, from 0 to 100.
+ * @return the latency in nanoseconds.
+ */
+uint64_t bench_hist_percentile(const bench_hist_t* hist, double percentile) {
+    uint64_t rank = (uint64_t) ceil(hist->total * percentile / 100);
+    uint64_t seen = 0;
+    for (int b = 0; b < BENCH_HIST_BUCKETS; b++) {
+        seen += hist->counts[b];
+        if (seen >= rank && seen > 0) {
+            return bench_hist_upper(b);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Random number from 0 (inclusive) to 1 (exclusive).
+ *
+ * @param seed the state of the thread's random numbers.
+ * @return the number.
+ */
+double bench_uniform(unsigned int* seed) {
+    return (double) rand_r(seed) / ((double) RAND_MAX + 1);
+}
+
+/**
+ * Set up the constants of the Zipfian generator of Gray et al. ("Quickly generating billion-record
+ * synthetic databases"), as used by YCSB. zeta(n) takes O(n) once, then every sample is O(1).
+ *
+ * @param worker the thread to set up.
+ * @param theta the skew. Must be between 0 and 1 (exclusive).
+ */
+void bench_zipf_init(bench_worker_t* worker, double theta) {
+    double zetan = 0;
+    for (unsigned long i = 1; i <= worker->allocs; i++) {
+        zetan += 1 / pow((double) i, theta);
+    }
+    double zeta2 = 1 + 1 / pow(2, theta);
+    worker->zipf_zetan = zetan;
+    worker->zipf_alpha = 1 / (1 - theta);
+    worker->zipf_eta = (1 - pow(2.0 / worker->allocs, 1 - theta)) / (1 - zeta2 / zetan);
+}
+
+/**
+ * Next Zipfian rank, from 0 (the most popular) to allocs - 1.
+ *
+ * @param worker the thread.
+ * @param theta the skew.
+ * @return the rank.
+ */
+unsigned long bench_zipf_next(bench_worker_t* worker, double theta) {
+    double u = bench_uniform(&worker->seed);
+    double uz = u * worker->zipf_zetan;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < 1 + pow(0.5, theta)) {
+        return 1;
+    }
+    unsigned long rank = (unsigned long) (worker->allocs * pow(worker->zipf_eta * u - worker->zipf_eta + 1, worker->zipf_alpha));
+    return rank < worker->allocs ? rank : worker->allocs - 1;
+}
+
+/**
+ * Next allocation a workload thread accesses.
+ *
+ * @param worker the thread.
+ * @param op the number of operations the thread has done so far.
+ * @return the index of the allocation.
+ */
+unsigned long bench_next_index(bench_worker_t* worker, unsigned long op) {
+    const bench_options_t* options = worker->options;
+    unsigned long allocs = worker->allocs;
+
+    switch (options->pattern) {
+        case BENCH_ZIPF: {
+            // scatter ranks over the allocations so the popular ones don't all land in one shard.
+            uint64_t rank = bench_zipf_next(worker, options->zipf_theta);
+            return (rank * 0x9e3779b97f4a7c15ULL >> 17) % allocs;
+        }
+        case BENCH_SCAN:
+            return (worker->id * allocs / options->threads + op) % allocs;
+        case BENCH_SHIFT: {
+            unsigned long hot = options->heap_pages / 2 ? options->heap_pages / 2 : 1;
+            unsigned long phase = op * BENCH_SHIFT_PHASES / options->ops;
+            return (phase * hot + rand_r(&worker->seed) % hot) % allocs;
+        }
+        default:
+            return rand_r(&worker->seed) % allocs;
+    }
+}
+
+/**
+ * Workload thread: does the workload's operations on the shared allocations, timing each one and
+ * counting the ones whose page was already in memory.
+ *
+ * @param data the thread's bench_worker_t.
+ * @return NULL always.
+ */
+void* bench_workload_thread(void* data) {
+    bench_worker_t* worker = (bench_worker_t*) data;
+    const bench_options_t* options = worker->options;
+
+    for (unsigned long op = 0; op < options->ops; op++) {
+        page_t* ptr = worker->ptrs[bench_next_index(worker, op)];
+        int pos = (int) (op % options->page_size);
+        bool write = rand_r(&worker->seed) % 100 >= options->read_percent;
+
+        double start = bench_now_ns();
+        if (write) {
+            pm_put(ptr, pos, (char) op, NULL);
+        } else {
+            pm_access(ptr, pos, NULL);
+        }
+        uint64_t ns = (uint64_t) (bench_now_ns() - start);
+
+        worker->hist.counts[bench_hist_bucket(ns)]++;
+        worker->hist.total++;
+    }
+
+    return NULL;
+}
+
+/**
+ * Run one pattern of the workload benchmark and print its CSV line.
+ *
+ * @param options the options, with a single pattern.
+ * @return true if the heap could be set up, false otherwise.
+ */
+bool bench_workload(const bench_options_t* options) {
+    pm_config_t config = {
+        .page_size = options->page_size, .heap_pages = options->heap_pages, .disk_pages = options->disk_pages,
+        .shards = options->shards, .flusher = options->flusher, .policy = options->policy,
+        .zpool_bytes = options->zpool_bytes, .swap_mmap = options->swap_mmap, .dedup = options->dedup,
+        .readahead = options->readahead, .evict_batch = options->evict_batch
+    };
+    if (!pm_init_config(&config)) {
+        return false;
+    }
+
+    // fill every allocation, which leaves the last ones in memory.
+    unsigned long allocs = options->heap_pages + options->disk_pages;
+    page_t** ptrs = malloc(allocs * sizeof(page_t*));
+    for (unsigned long i = 0; i < allocs; i++) {
+        ptrs[i] = pm_malloc(options->page_size, NULL);
+        pm_put(ptrs[i], 0, (char) i, NULL);
+    }
+
+    bench_worker_t* workers = calloc(options->threads, sizeof(bench_worker_t));
+    pthread_t* threads = malloc(options->threads * sizeof(pthread_t));
+    for (int t = 0; t < options->threads; t++) {
+        workers[t].options = options;
+        workers[t].ptrs = ptrs;
+        workers[t].allocs = allocs;
+        workers[t].id = t;
+        workers[t].seed = t + 1;
+        if (options->pattern == BENCH_ZIPF) {
+            bench_zipf_init(&workers[t], options->zipf_theta);
+        }
+    }
+
+    // only count the statistics of the workload, not of filling the allocations.
+    pm_stats_t before, after;
+    pm_get_stats(&before);
+
+    double start = bench_now_ns();
+    for (int t = 0; t < options->threads; t++) {
+        pthread_create(&threads[t], NULL, bench_workload_thread, &workers[t]);
+    }
+    for (int t = 0; t < options->threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = bench_now_ns() - start;
+    pm_get_stats(&after);
+
+    // merge the threads' histograms.
+    bench_hist_t hist;
+    memset(&hist, 0, sizeof(hist));
+    for (int t = 0; t < options->threads; t++) {
+        for (int b = 0; b < BENCH_HIST_BUCKETS; b++) {
+            hist.counts[b] += workers[t].hist.counts[b];
+        }
+        hist.total += workers[t].hist.total;
+    }
+
+    unsigned long accesses = after.accesses - before.accesses;
+    printf("%s,%s,%s,%d,%u,%lu,%lu,%lu,%d,%.0f,%.4f,%llu,%llu,%llu,%lu,%lu,%lu,%lu,%lu,%lu,%.0f,%.0f\n",
+        bench_pattern_names[options->pattern], bench_policy_names[options->policy],
+        options->swap_mmap ? "mmap" : "pread", options->threads,
+        options->shards, options->page_size, options->heap_pages, options->disk_pages, options->read_percent,
+        hist.total / (elapsed / 1e9), accesses ? (double) (after.hits - before.hits) / accesses : 0,
+        (unsigned long long) bench_hist_percentile(&hist, 50), (unsigned long long) bench_hist_percentile(&hist, 99),
+        (unsigned long long) bench_hist_percentile(&hist, 99.9), after.evictions - before.evictions,
+        after.disk_reads - before.disk_reads, after.disk_writes - before.disk_writes,
+        after.write_calls - before.write_calls, (after.bytes_written - before.bytes_written) / 1024, (after.bytes_skipped - before.bytes_skipped) / 1024,
+        (after.lock_wait_ns - before.lock_wait_ns) / 1e6, (after.io_ns - before.io_ns) / 1e6);
+
+    for (unsigned long i = 0; i < allocs; i++) {
+        pm_free(ptrs[i], NULL);
+    }
+    free(threads);
+    free(workers);
+    free(ptrs);
+    pm_cleanup(false);
+    return true;
+}
+
+/**
+ * Parse a key=value argument of the workload benchmark.
+ *
+ * @param options the options to update.
+ * @param arg the argument.
+ * @return true if the argument is valid, false otherwise.
+ */
+bool bench_parse_option(bench_options_t* options, const char* arg) {
+    const char* eq = strchr(arg, '=');
+    if (!eq) {
+        return false;
+    }
+    unsigned long key_len = eq - arg;
+    const char* value = eq + 1;
+
+    if (strncmp(arg, "pattern", key_len) == 0 && key_len == 7) {
+        for (int p = 0; p < BENCH_PATTERNS; p++) {
+            if (strcmp(value, bench_pattern_names[p]) == 0) {
+                options->pattern = p;
+                return true;
+            }
+        }
+        return strcmp(value, "all") == 0;
+    }
+    if (strncmp(arg, "policy", key_len) == 0 && key_len == 6) {
+        for (int p = 0; p < (int) (sizeof(bench_policy_names) / sizeof(bench_policy_names[0])); p++) {
+            if (strcmp(value, bench_policy_names[p]) == 0) {
+                options->policy = (pm_policy_t) p;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    char* end;
+    double number = strtod(value, &end);
+    if (*value == '\0' || *end != '\0' || number < 0) {
+        return false;
+    }
+    if (strncmp(arg, "threads", key_len) == 0 && key_len == 7) {
+        options->threads = (int) number;
+        return options->threads >= 1 && options->threads <= BENCH_MAX_THREADS;
+    } else if (strncmp(arg, "ops", key_len) == 0 && key_len == 3) {
+        options->ops = (unsigned long) number;
+        return options->ops > 0;
+    } else if (strncmp(arg, "reads", key_len) == 0 && key_len == 5) {
+        options->read_percent = (int) number;
+        return options->read_percent <= 100;
+    } else if (strncmp(arg, "page", key_len) == 0 && key_len == 4) {
+        options->page_size = (unsigned long) number;
+        return options->page_size > 0;
+    } else if (strncmp(arg, "heap", key_len) == 0 && key_len == 4) {
+        options->heap_pages = (unsigned long) number;
+        return options->heap_pages > 0;
+    } else if (strncmp(arg, "disk", key_len) == 0 && key_len == 4) {
+        options->disk_pages = (unsigned long) number;
+        return true;
+    } else if (strncmp(arg, "shards", key_len) == 0 && key_len == 6) {
+        options->shards = (unsigned int) number;
+        return options->shards > 0;
+    } else if (strncmp(arg, "flusher", key_len) == 0 && key_len == 7) {
+        options->flusher = number != 0;
+        return true;
+    } else if (strncmp(arg, "mmap", key_len) == 0 && key_len == 4) {
+        options->swap_mmap = number != 0;
+        return true;
+    } else if (strncmp(arg, "zpool", key_len) == 0 && key_len == 5) {
+        options->zpool_bytes = (unsigned long) number;
+        return true;
+    } else if (strncmp(arg, "dedup", key_len) == 0 && key_len == 5) {
+        options->dedup = number != 0;
+        return true;
+    } else if (strncmp(arg, "readahead", key_len) == 0 && key_len == 9) {
+        options->readahead = (unsigned int) number;
+        return options->readahead <= READAHEAD_MAX;
+    } else if (strncmp(arg, "evict_batch", key_len) == 0 && key_len == 11) {
+        options->evict_batch = (unsigned int) number;
+        return options->evict_batch <= EVICT_BATCH_MAX;
+    } else if (strncmp(arg, "theta", key_len) == 0 && key_len == 5) {
+        options->zipf_theta = number;
+        return number > 0 && number < 1;
+    }
+    return false;
+}
+
+int main(int argc, char* argv[]) {
+    const char* which = argc > 1 ? argv[1] : "all";
+
+    // miss latency should stay flat as the number of allocations grows.
+    if (strcmp(which, "all") == 0 || strcmp(which, "lru") == 0) {
+        printf("# miss latency, page size = %d B\n", BENCH_PAGE_SIZE);
+        printf("allocs,ns_per_miss\n");
+        for (unsigned long allocs = 1024; allocs <= 65536; allocs *= 4) {
+            double ns = bench_miss_latency(allocs);
+            if (ns < 0) {
+                printf("Error: couldn't initialize heap with %lu allocations\n", allocs);
+                return 1;
+            }
+            printf("%lu,%.0f\n", allocs, ns);
+        }
+    }
+
+    // throughput should scale with the number of threads when there is a shard per thread.
+    if (strcmp(which, "all") == 0 || strcmp(which, "threads") == 0) {
+        printf("# malloc / free / put / access throughput, page size = %d B\n", BENCH_PAGE_SIZE);
+        printf("threads,shards,thread_cache,ops_per_sec\n");
+        for (int threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2) {
+            unsigned int shard_options[] = { 1, threads };
+            for (int i = 0; i < (threads > 1 ? 2 : 1); i++) {
+                for (unsigned int cache = 0; cache <= BENCH_THREAD_CACHE; cache += BENCH_THREAD_CACHE) {
+                    double ops = bench_scaling(threads, shard_options[i], cache);
+                    if (ops < 0) {
+                        printf("Error: couldn't initialize heap for %d threads\n", threads);
+                        return 1;
+                    }
+                    printf("%d,%u,%u,%.0f\n", threads, shard_options[i], cache, ops);
+                }
+            }
+        }
+    }
+
+    // read-mostly throughput should scale with the number of threads even on a single shard.
+    if (strcmp(which, "all") == 0 || strcmp(which, "readers") == 0) {
+        printf("# %d%% pm_access / %d%% pm_put throughput on shared allocations, page size = %d B\n",
+            BENCH_READ_PERCENT, 100 - BENCH_READ_PERCENT, BENCH_PAGE_SIZE);
+        printf("threads,ops_per_sec\n");
+        for (int threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2) {
+            double ops = bench_readers(threads);
+            if (ops < 0) {
+                printf("Error: couldn't initialize heap for %d threads\n", threads);
+                return 1;
+            }
+            printf("%d,%.0f\n", threads, ops);
+        }
+    }
+
+    // throughput, hit ratio and latency percentiles of each access pattern.
+    if (strcmp(which, "all") == 0 || strcmp(which, "workload") == 0) {
+        bench_options_t options = {
+            .pattern = BENCH_PATTERNS, .threads = 1, .ops = 200000, .read_percent = BENCH_READ_PERCENT,
+            .page_size = BENCH_PAGE_SIZE, .heap_pages = 1024, .disk_pages = 3072, .shards = 1,
+            .policy = PM_POLICY_LRU, .zipf_theta = 0.99
+        };
+        for (int i = 2; i < argc; i++) {
+            if (!bench_parse_option(&options, argv[i])) {
+                printf("Error: invalid workload option %s\n", argv[i]);
+                printf("Options: pattern=uniform|zipf|scan|shift|all policy=lru|clock|2q|arc threads=N ops=N "
+                    "reads=PERCENT page=BYTES heap=PAGES disk=PAGES shards=N flusher=0|1 mmap=0|1 zpool=BYTES "
+                    "dedup=0|1 readahead=PAGES evict_batch=PAGES theta=SKEW\n");
+                return 1;
+            }
+        }
+
+        printf("# workload throughput, hit ratio and latency percentiles\n");
+        printf("pattern,policy,swap,threads,shards,page_size,heap_pages,disk_pages,read_pct,ops_per_sec,hit_ratio,p50_ns,p99_ns,p999_ns,"
+            "evictions,disk_reads,disk_writes,write_calls,kb_written,kb_skipped,lock_wait_ms,io_ms\n");
+        int first = options.pattern == BENCH_PATTERNS ? 0 : options.pattern;
+        int last = options.pattern == BENCH_PATTERNS ? BENCH_PATTERNS - 1 : options.pattern;
+        for (int p = first; p <= last; p++) {
+            options.pattern = p;
+            if (!bench_workload(&options)) {
+                printf("Error: couldn't initialize heap for the %s workload\n", bench_pattern_names[p]);
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
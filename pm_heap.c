@@ -6,379 +6,4337 @@
 */
 
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "pm_heap.h"
+#include "pm_lz.h"
+
+// number of 64-bit words needed to hold the given number of bits.
+#define BITMAP_WORDS(bits) (((bits) + 63) / 64)
+// how long the flusher sleeps between passes unless it is woken up, in milliseconds.
+#define FLUSH_INTERVAL_MS 10
+
+// number of workers for pm_access_async if the config doesn't say.
+#define ASYNC_WORKERS 4
+
+// size of the chunks compressed pages are stored in, in bytes.
+#define ZPOOL_CHUNK 64
+
+// most pages written to consecutive swap slots with a single pwritev.
+#define WRITE_RUN_MAX 64
+
+// smallest block of a page whose changes are tracked, in bytes. A page has at most 64 blocks.
+#define DIRTY_BLOCK 512
+
+// dedup_next of a swap slot that isn't in its shard's dedup table.
+#define DEDUP_NONE -2
+
+// strides in a row that must be the same to start readahead, so it starts at the third access along a
+// stride, and the largest stride followed.
+#define READAHEAD_STREAK 2
+#define READAHEAD_STRIDE 64
+
+// smallest pm_obj size class in bytes, and most size classes. Classes double up to half a page.
+#define OBJ_MIN 16UL
+#define OBJ_CLASSES 16
+// size class of a pm_obj handle for an object of whole pages.
+#define OBJ_SPAN 0xff
+// pack and unpack a pm_obj handle: alloc_idx + 1 in the high 32 bits, then 8 bits of size class and 24 of slot.
+#define OBJ_HANDLE(alloc_idx, size_class, slot) \
+    (((pm_obj_t) (alloc_idx) + 1) << 32 | (pm_obj_t) (size_class) << 24 | (slot))
+#define OBJ_ALLOC(obj) ((long) ((obj) >> 32) - 1)
+#define OBJ_CLASS(obj) ((unsigned int) ((obj) >> 24) & 0xff)
+#define OBJ_SLOT(obj) ((unsigned int) (obj) & 0xffffff)
+
+// most lists of allocations a replacement policy keeps per shard.
+#define PM_LISTS 4
+
+// identifies a metadata file saved by pm_checkpoint, and the slot saved for a free allocation.
+#define META_MAGIC "PMHEAP01"
+#define META_FREE -2
+
+// round a region size up so the next region starts on a cache line.
+#define ALIGN64(bytes) (((bytes) + 63) & ~63UL)
+
+// Two-level bitmap of used slots. A set bit in words means the slot is in use, and a set bit in
+// summary means the corresponding word is full, so a free slot is found with two ctz's.
+struct pm_bitmap {
+    // one bit per slot.
+    uint64_t* words;
+    // one bit per word of words.
+    uint64_t* summary;
+    // number of words in summary.
+    unsigned long summary_words;
+    // no summary word before this one has a free slot.
+    unsigned long hint;
+};
+typedef struct pm_bitmap pm_bitmap_t;
+
+// Doubly linked list of allocations threaded through page_t.lru_prev / lru_next. The head is the end
+// allocations are added at, and the tail the end victims are taken from.
+struct pm_list {
+    int head;
+    int tail;
+    unsigned long len;
+};
+typedef struct pm_list pm_list_t;
+
+// A shard owns a contiguous range of the pages in memory, the allocations and their swap slots, with
+// its own lock, free maps and replacement lists. Operations on an allocation only take the lock of its shard.
+struct pm_shard {
+    // lock access to the shard's pages, allocations, swap slots and replacement lists.
+    pthread_mutex_t lock;
+    // lock the entries of obj_slabs and obj_spans of the shard's allocations. It's held shared while an object
+    // is copied and exclusively while pm_obj_free takes one out, so an object isn't freed during a copy.
+    pthread_rwlock_t obj_lock;
+    // first page in memory and number of pages in memory owned by this shard.
+    unsigned long page_base;
+    unsigned long page_count;
+    // first allocation (and swap slot) and number of allocations owned by this shard.
+    unsigned long alloc_base;
+    unsigned long alloc_count;
+    // free maps, indexed relative to page_base / alloc_base.
+    pm_bitmap_t avail_pages;
+    pm_bitmap_t avail_allocs;
+    pm_bitmap_t avail_slots;
+    // lists of the replacement policy. Lists before policy->resident_lists hold the allocations in
+    // memory, and the ones after it remember allocations evicted recently.
+    pm_list_t lists[PM_LISTS];
+    // ARC: target number of pages in memory on the recency list.
+    unsigned long arc_target;
+    // allocation the flusher is writing back without the lock, or -1. It can't be evicted meanwhile.
+    // flush_done is signalled when the write is over.
+    int flush_alloc;
+    pthread_cond_t flush_done;
+    // if true, flush_alloc was freed during its write back, and the flusher releases its swap slot.
+    bool flush_slot_freed;
+    // the slot flush_alloc is written to, or -1 once pm_swap_slot took it over, and whether the write is
+    // done, which is set under flusher_lock.
+    int flush_slot;
+    bool flush_written;
+    // number of pages at the cold end of each list in memory the flusher keeps clean.
+    unsigned long flush_watermark;
+    // compressed pool: first chunk and number of chunks owned by this shard, their free map (indexed
+    // relative to zchunk_base) and how many are free.
+    unsigned long zchunk_base;
+    unsigned long zchunk_count;
+    pm_bitmap_t avail_zchunks;
+    unsigned long zchunks_free;
+    // allocations in the pool in the order they were stored (head is the newest), linked through pm_zentry_t.
+    int zhead;
+    int ztail;
+    // three page_size buffers: compressed output, compressed input and a decompressed page.
+    char* zscratch;
+    // with pm_config_t.dedup, the shard's swap slots indexed by the hash of their contents, as a power of two
+    // of buckets chained through dedup_next, and a page_size buffer to read a slot into to compare it.
+    int* dedup_buckets;
+    unsigned long dedup_mask;
+    char* dedup_scratch;
+} __attribute__((aligned(64)));
+typedef struct pm_shard pm_shard_t;
+
+// A page held compressed in a shard's pool, indexed by alloc_idx. Its bytes are spread over a chain of
+// chunks linked through zchunk_next.
+struct pm_zentry {
+    // first chunk of the compressed page, or -1 if the allocation isn't in the pool.
+    int chunk;
+    // number of compressed bytes.
+    unsigned int len;
+    // newer and older allocation in the shard's pool, or -1.
+    int prev;
+    int next;
+};
+typedef struct pm_zentry pm_zentry_t;
+
+// A page replacement policy. Every hook is called with the shard's lock held.
+struct pm_policy_ops {
+    // number of lists holding the allocations in memory. They come first in pm_shard_t.lists.
+    int resident_lists;
+    // incoming is about to be brought into memory, before a page is evicted to make room for it. May be NULL.
+    void (*fault)(pm_shard_t* shard, page_t* incoming);
+    // page was brought into memory, or unpinned.
+    void (*insert)(pm_shard_t* shard, page_t* page);
+    // page in memory was accessed with the lock held.
+    void (*access)(pm_shard_t* shard, page_t* page);
+    // choose the page in memory to evict to make room for incoming, or NULL if every page is pinned.
+    page_t* (*victim)(pm_shard_t* shard, page_t* incoming);
+    // page is leaving memory because it was evicted.
+    void (*evict)(pm_shard_t* shard, page_t* page);
+};
+typedef struct pm_policy_ops pm_policy_ops_t;
+
+// Header of the metadata file saved by pm_checkpoint. It is followed by an int32_t per allocation: its swap
+// slot, -1 if it was never written to disk, or META_FREE. checksum covers the header (with checksum 0) and
+// the slots, and the geometry must match the heap's for the file to be reattached.
+struct pm_meta_header {
+    char magic[8];
+    uint64_t page_size;
+    uint64_t allocs;
+    uint32_t shards;
+    uint32_t reserved;
+    uint64_t checksum;
+};
+typedef struct pm_meta_header pm_meta_header_t;
+
+// Allocations a thread keeps for pm_malloc and pm_free without its home shard's lock, with
+// pm_config_t.thread_cache. Every allocation in the cache is marked as used in its shard and has
+// page_t.cached set. A cache filled for an earlier heap has an older generation, and is emptied.
+struct pm_thread_cache {
+    unsigned long generation;
+    // allocations reserved for pm_malloc, which are not in memory and hold '\0'. Up to twice the batch size.
+    unsigned int reserved_count;
+    int* reserved;
+    // allocations freed by pm_free, which are released once a batch is full.
+    unsigned int freed_count;
+    int* freed;
+};
+typedef struct pm_thread_cache pm_thread_cache_t;
+
+// a pm_access_async call waiting for a worker, followed by room for the bytes it reads.
+typedef struct pm_async_req {
+    struct pm_async_req* next;
+    page_t* ptr;
+    unsigned long off;
+    unsigned long len;
+    pm_access_cb_t cb;
+    void* ctx;
+    char data[];
+} pm_async_req_t;
+
+// A page holding pm_obj objects of one size class, indexed by alloc_idx in obj_slabs. Its map of used slots
+// is kept out of the page, so objects are allocated and freed without bringing the page into memory.
+struct pm_slab {
+    page_t* page;
+    unsigned int size_class;
+    // the class list the page is on while it has a free slot, and its neighbours there.
+    struct pm_slab_class* cls;
+    struct pm_slab* prev;
+    struct pm_slab* next;
+    unsigned int used;
+    // no word of used_map before this one has a free slot.
+    unsigned int hint;
+    // slots from this one on were never used, and still hold '\0'.
+    unsigned int fresh;
+    // one bit per slot, set while the slot holds an object.
+    uint64_t used_map[];
+};
+typedef struct pm_slab pm_slab_t;
+
+// A shard's pages of one pm_obj size class that have a free slot. Each thread allocates objects from the
+// classes of its home shard, and an object is freed back to its page's class.
+struct pm_slab_class {
+    // lock access to the list and the used maps of its pages.
+    pthread_mutex_t lock;
+    unsigned long size;
+    unsigned int slots;
+    pm_slab_t* partial;
+} __attribute__((aligned(64)));
+typedef struct pm_slab_class pm_slab_class_t;
+
+// A pm_obj object of whole pages, indexed by the alloc_idx of its first page in obj_spans.
+struct pm_span {
+    unsigned long bytes;
+    unsigned long count;
+    page_t* pages[];
+};
+typedef struct pm_span pm_span_t;
 
 // print internal state of heap
 void pm_print_debug(debug_t* debug_info, void* ptr);
 void pm_print_allocations();
 
-// lock access to shared variables (allocations, pm_heap_pages, pm_heap)
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// lock initialization and cleanup of the heap.
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// split physical memory into regions: pages, allocation structures and shards (with their free maps).
+// The arena is mapped at pm_init_config time and its regions are sized from the runtime geometry.
+static char* pm_heap;
+static unsigned long pm_heap_size;
+
+// runtime geometry (see pm_config_t).
+static unsigned long page_size;
+static unsigned long heap_pages;
+static unsigned long disk_pages;
+static char disk_dir[PATH_MAX - 32];
+static unsigned int shard_count;
+static bool steal_pages;
+static unsigned long flush_watermark;
+static pm_policy_t policy_kind;
+static const pm_policy_ops_t* policy;
+static unsigned long zpool_bytes;
+
+// background thread that writes back dirty pages near the cold end of each list in memory, so evictions only
+// drop clean pages. flusher_lock protects flusher_stop, flusher_kicked and the shards' flush_written, which
+// flush_write_cond signals.
+static bool flusher_running;
+static pthread_t flusher_thread;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flush_write_cond = PTHREAD_COND_INITIALIZER;
+static bool flusher_stop;
+static bool flusher_kicked;
+
+// worker threads that fault pages in for pm_access_async, started on the first fault. async_lock protects
+// the queue of requests and the rest of the pool's state.
+static unsigned int async_workers;
+static unsigned int async_started;
+static pthread_t* async_threads;
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static pm_async_req_t* async_head;
+static pm_async_req_t* async_tail;
+static bool async_stop;
+
+// total number of allocations: every allocation is a single page, either in memory or on disk.
+static unsigned long total_allocs;
+
+// single preallocated swap file, split into page_size slots. There is a slot for every allocation
+// so that clean pages in memory can keep their copy on disk.
+static int swap_fd = -1;
+static char swap_filename[PATH_MAX];
+
+// With pm_config_t.swap_mmap, the whole swap file is mapped shared and pages are copied in and out of
+// the mapping instead of using pread / pwrite. swap_drop is true if page_size is a multiple of the system
+// page size, so a slot's mapping can be dropped once it's copied.
+static char* swap_map;
+static bool swap_drop;
+
+// With pm_config_t.persist, the allocation table and swap slots are saved to a metadata file next to the
+// swap file. meta_saved is true while the file matches the swap file, and the first write to the swap file
+// after that removes the file under meta_lock, so a crash never reattaches slots that were overwritten.
+static bool persist;
+static char meta_filename[PATH_MAX];
+static bool meta_saved;
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// regions carved out of pm_heap.
+static page_t* alloc_region;
+static pm_shard_t* shards;
+
+// Sequence counter per page in memory, for reading resident pages without a lock. A counter is odd while
+// the page's contents or the allocation it holds are being changed under its shard's lock.
+static unsigned int* page_seqs;
+
+// Blocks of each page in memory changed since its swap slot was last written, one bit per block of
+// dirty_block_size bytes, under its shard's lock. A page's mask only means something while it is dirty,
+// and a page is written back a run of dirty blocks at a time if its slot holds the rest of it.
+static uint64_t* dirty_blocks;
+static unsigned long dirty_block_size;
+static unsigned long dirty_block_count;
+static uint64_t dirty_all;
+
+// Compressed pool, if pm_config_t.zpool_bytes is set: an entry per allocation, and the chunks of every
+// shard with the next chunk of each in its chain (-1 at the end of a chain).
+static pm_zentry_t* zentries;
+static int* zchunk_next;
+static char* zchunks;
+
+// Number of allocations whose swap_slot is each slot, which is more than one only if identical pages share
+// it. With pm_config_t.dedup, also the hash of the contents of a slot in its shard's table, and the next slot
+// in its bucket (-1 at the end of a chain, DEDUP_NONE if the slot isn't in the table).
+static unsigned int* slot_refs;
+static bool dedup;
+static uint64_t* slot_hashes;
+static int* dedup_next;
+
+// With pm_config_t.readahead, each thread follows the stride between the allocations it faults in, or
+// accesses for the first time after readahead brought them in. streak counts the strides in a row equal to
+// stride. Once it reaches READAHEAD_STREAK, the next readahead_pages allocations along it are read ahead,
+// and next is the first not yet read.
+struct pm_readahead {
+    unsigned long generation;
+    long last;
+    long stride;
+    unsigned int streak;
+    long next;
+};
+typedef struct pm_readahead pm_readahead_t;
+
+static unsigned int readahead_pages;
+static __thread pm_readahead_t thread_readahead;
+
+// most pages a shard evicts at once (see pm_config_t.evict_batch).
+static unsigned int evict_batch;
+
+// threads are spread over the shards for pm_malloc in the order they first allocate.
+static unsigned int thread_count;
+static __thread unsigned int thread_seq;
+static __thread bool thread_seq_set;
+
+// thread caches (see pm_thread_cache_t), with thread_cache_size allocations per batch. 0 disables them.
+// heap_generation is bumped by every pm_init_config.
+static unsigned int thread_cache_size;
+static unsigned long heap_generation;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static __thread pm_thread_cache_t* thread_cache;
+
+// Statistics are counted per thread, so counting never contends. Each thread's counters are only written
+// by that thread (with relaxed atomic stores, so pm_get_stats reads them whole) and are linked into a list
+// for pm_get_stats to sum. When a thread exits, its counters are added to stats_retired and unlinked.
+struct pm_thread_stats {
+    pm_stats_t counters;
+    struct pm_thread_stats* prev;
+    struct pm_thread_stats* next;
+};
+typedef struct pm_thread_stats pm_thread_stats_t;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static pm_thread_stats_t* stats_threads;
+static pm_stats_t stats_retired;
+static __thread pm_thread_stats_t* thread_stats;
+
+// add n to a counter of this thread's statistics.
+#define PM_STAT_ADD(field, n) do { \
+        pm_stats_t* stats_ = pm_thread_counters(); \
+        __atomic_store_n(&stats_->field, stats_->field + (n), __ATOMIC_RELAXED); \
+    } while (0)
+
+// a page of '\0' that is never written, read in place of allocations that hold only '\0' and aren't in memory.
+static char* zero_page;
+
+// pm_obj size classes, OBJ_CLASSES per shard of which the first obj_classes are used, and the allocations
+// holding objects by alloc_idx. An entry of obj_slabs or obj_spans is set while its allocation is in use.
+static pm_slab_class_t* slab_classes;
+static unsigned int obj_classes;
+static pm_slab_t** obj_slabs;
+static pm_span_t** obj_spans;
+
+// Traced events are recorded per thread too, in a ring of trace_size events that only its thread writes.
+// head counts the events ever recorded and is published with a release store after each one, and the ring
+// holds the latest size of them. Rings are never freed: when a thread exits, its ring is reused by the next
+// thread that records an event. trace_lock protects the list of rings and which are in use.
+struct pm_trace_ring {
+    unsigned long head;
+    unsigned long size;
+    bool in_use;
+    // number of the thread using the ring, for its events.
+    uint16_t thread;
+    struct pm_trace_ring* next;
+    pm_trace_event_t events[];
+};
+typedef struct pm_trace_ring pm_trace_ring_t;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static pm_trace_ring_t* trace_rings;
+static unsigned long trace_size;
+static unsigned int trace_threads;
+// pm_now_ns at pm_init_config, which event times count from.
+static unsigned long trace_epoch;
+static __thread pm_trace_ring_t* thread_trace;
+
+//------------ Helper functions not declared in pm_heap.h ---------------------//
+
+/**
+ * Current time in nanoseconds from a monotonic clock.
+ *
+ * @return the time in nanoseconds.
+ */
+unsigned long pm_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * Add one set of statistics to another.
+ *
+ * @param total the statistics to add to.
+ * @param counters the statistics to add, which may be written concurrently by their thread.
+ */
+void pm_stats_add(pm_stats_t* total, pm_stats_t* counters) {
+    unsigned long* dst = (unsigned long*) total;
+    unsigned long* src = (unsigned long*) counters;
+    for (unsigned long i = 0; i < sizeof(pm_stats_t) / sizeof(unsigned long); i++) {
+        dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Fold the statistics of an exiting thread into stats_retired.
+ *
+ * @param data the thread's pm_thread_stats_t.
+ */
+void pm_stats_retire(void* data) {
+    pm_thread_stats_t* stats = (pm_thread_stats_t*) data;
+
+    pthread_mutex_lock(&stats_lock);
+    pm_stats_add(&stats_retired, &stats->counters);
+    if (stats->prev) {
+        stats->prev->next = stats->next;
+    } else {
+        stats_threads = stats->next;
+    }
+    if (stats->next) {
+        stats->next->prev = stats->prev;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    free(stats);
+}
+
+/**
+ * Create the key whose destructor retires a thread's statistics.
+ */
+void pm_stats_key_create() {
+    pthread_key_create(&stats_key, pm_stats_retire);
+}
+
+/**
+ * This thread's statistics, registered on first use.
+ *
+ * @return the counters to add to.
+ */
+pm_stats_t* pm_thread_counters() {
+    if (thread_stats) {
+        return &thread_stats->counters;
+    }
+
+    pthread_once(&stats_once, pm_stats_key_create);
+    pm_thread_stats_t* stats = calloc(1, sizeof(pm_thread_stats_t));
+    if (!stats) {
+        // count into the retired statistics rather than fail the caller. Races only cost accuracy.
+        return &stats_retired;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    stats->next = stats_threads;
+    if (stats_threads) {
+        stats_threads->prev = stats;
+    }
+    stats_threads = stats;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(stats_key, stats);
+    thread_stats = stats;
+    return &stats->counters;
+}
+
+/**
+ * Give up the trace ring of an exiting thread, so the next new thread can reuse it.
+ *
+ * @param data the thread's pm_trace_ring_t.
+ */
+void pm_trace_release(void* data) {
+    pm_trace_ring_t* ring = (pm_trace_ring_t*) data;
+
+    // an event recorded after this, e.g. by the thread cache's destructor, takes a ring again.
+    thread_trace = NULL;
+    pthread_mutex_lock(&trace_lock);
+    ring->in_use = false;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Create the key whose destructor releases a thread's trace ring.
+ */
+void pm_trace_key_create() {
+    pthread_key_create(&trace_key, pm_trace_release);
+}
+
+/**
+ * This thread's trace ring, taken on first use from the rings of exited threads or allocated.
+ *
+ * @return the ring, or NULL if there is none to record into.
+ */
+pm_trace_ring_t* pm_trace_ring() {
+    if (thread_trace) {
+        return thread_trace;
+    }
+    if (!trace_size) {
+        return NULL;
+    }
+
+    pthread_once(&trace_once, pm_trace_key_create);
+    pthread_mutex_lock(&trace_lock);
+    pm_trace_ring_t* ring = trace_rings;
+    while (ring && (ring->in_use || ring->size != trace_size)) {
+        ring = ring->next;
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(pm_trace_ring_t) + trace_size * sizeof(pm_trace_event_t));
+        if (!ring) {
+            // go untraced rather than fail the caller.
+            pthread_mutex_unlock(&trace_lock);
+            return NULL;
+        }
+        ring->size = trace_size;
+        ring->next = trace_rings;
+        trace_rings = ring;
+    }
+    ring->in_use = true;
+    ring->thread = trace_threads++;
+    pthread_mutex_unlock(&trace_lock);
+
+    pthread_setspecific(trace_key, ring);
+    thread_trace = ring;
+    return ring;
+}
+
+/**
+ * Record an operation in this thread's trace ring. Never blocks, and overwrites the oldest event.
+ *
+ * @param type the kind of operation.
+ * @param alloc_idx the allocation, or -1.
+ * @param arg the offset, page in memory or shard, as described in pm_trace_event_t.
+ * @param flags PM_TRACE_* flags.
+ * @param start pm_now_ns when the operation started.
+ */
+void pm_trace(pm_trace_type_t type, int alloc_idx, int arg, int flags, unsigned long start) {
+    pm_trace_ring_t* ring = pm_trace_ring();
+    if (!ring) {
+        return;
+    }
+
+    unsigned long duration = pm_now_ns() - start;
+    pm_trace_event_t* event = &ring->events[ring->head & (ring->size - 1)];
+    event->time_ns = start - trace_epoch;
+    event->duration_ns = duration > UINT32_MAX ? UINT32_MAX : duration;
+    event->alloc_idx = alloc_idx;
+    event->arg = arg;
+    event->thread = ring->thread;
+    event->type = type;
+    event->flags = flags;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Lock a shard, counting the time spent waiting if it was held by another thread.
+ *
+ * @param shard the shard to lock.
+ */
+void pm_shard_lock(pm_shard_t* shard) {
+    if (pthread_mutex_trylock(&shard->lock) == 0) {
+        return;
+    }
+
+    unsigned long start = pm_now_ns();
+    pthread_mutex_lock(&shard->lock);
+    PM_STAT_ADD(lock_wait_ns, pm_now_ns() - start);
+    pm_trace(PM_TRACE_LOCK_WAIT, -1, shard - shards, 0, start);
+}
+
+/**
+ * Number of bytes of pm_heap a bitmap needs, including its summary.
+ *
+ * @param bits the number of slots tracked.
+ * @return the size of the bitmap in bytes.
+ */
+unsigned long pm_bitmap_bytes(unsigned long bits) {
+    unsigned long words = BITMAP_WORDS(bits);
+    return (words + BITMAP_WORDS(words)) * sizeof(uint64_t);
+}
+
+/**
+ * Set up a bitmap with every slot free on zeroed storage of pm_bitmap_bytes(bits) bytes.
+ *
+ * @param bitmap the bitmap to set up.
+ * @param storage where the words and summary live.
+ * @param bits the number of slots tracked.
+ */
+void pm_bitmap_init(pm_bitmap_t* bitmap, uint64_t* storage, unsigned long bits) {
+    unsigned long words = BITMAP_WORDS(bits);
+    bitmap->words = storage;
+    bitmap->summary = storage + words;
+    bitmap->summary_words = BITMAP_WORDS(words);
+    bitmap->hint = 0;
+
+    // mark the bits past the end as used so they are never handed out.
+    if (bits % 64 != 0) {
+        bitmap->words[words - 1] = ~0ULL << (bits % 64);
+    }
+    if (words % 64 != 0) {
+        bitmap->summary[bitmap->summary_words - 1] = ~0ULL << (words % 64);
+    }
+}
+
+/**
+ * Check if a slot is in use.
+ *
+ * @param bitmap the bitmap to check.
+ * @param idx the slot to check.
+ * @return true if the slot is in use.
+ */
+bool pm_bitmap_test(pm_bitmap_t* bitmap, unsigned long idx) {
+    return (bitmap->words[idx / 64] >> (idx % 64)) & 1;
+}
+
+/**
+ * Mark a slot as in use.
+ *
+ * @param bitmap the bitmap to update.
+ * @param idx the slot to mark.
+ */
+void pm_bitmap_set(pm_bitmap_t* bitmap, unsigned long idx) {
+    unsigned long w = idx / 64;
+    bitmap->words[w] |= 1ULL << (idx % 64);
+    if (bitmap->words[w] == ~0ULL) {
+        bitmap->summary[w / 64] |= 1ULL << (w % 64);
+    }
+}
+
+/**
+ * Mark a slot as free.
+ *
+ * @param bitmap the bitmap to update.
+ * @param idx the slot to mark.
+ */
+void pm_bitmap_clear(pm_bitmap_t* bitmap, unsigned long idx) {
+    unsigned long w = idx / 64;
+    bitmap->words[w] &= ~(1ULL << (idx % 64));
+    bitmap->summary[w / 64] &= ~(1ULL << (w % 64));
+    if (w / 64 < bitmap->hint) {
+        bitmap->hint = w / 64;
+    }
+}
+
+/**
+ * Find the lowest free slot. NOTE: does not mark as used.
+ *
+ * @param bitmap the bitmap to search.
+ * @return the index of a free slot or -1 if every slot is in use.
+ */
+long pm_bitmap_find(pm_bitmap_t* bitmap) {
+    // summary words before the hint are known to be full, so the search is amortized O(1).
+    for (unsigned long s = bitmap->hint; s < bitmap->summary_words; s++) {
+        if (bitmap->summary[s] != ~0ULL) {
+            bitmap->hint = s;
+            unsigned long w = s * 64 + __builtin_ctzll(~bitmap->summary[s]);
+            return w * 64 + __builtin_ctzll(~bitmap->words[w]);
+        }
+    }
+    bitmap->hint = bitmap->summary_words;
+
+    return -1;
+}
+
+/**
+ * Find the shard that owns an index when count indices are split evenly over the shards. Shard s owns
+ * indices floor(s * count / shard_count) up to (but not including) floor((s + 1) * count / shard_count).
+ *
+ * @param idx the index to look up.
+ * @param count the number of indices.
+ * @return the owning shard.
+ */
+pm_shard_t* pm_owner_shard(unsigned long idx, unsigned long count) {
+    return &shards[((idx + 1) * shard_count - 1) / count];
+}
+
+/**
+ * Find the shard that owns an allocation (and its swap slot).
+ *
+ * @param alloc_idx the allocation.
+ * @return the owning shard.
+ */
+pm_shard_t* pm_alloc_shard(unsigned long alloc_idx) {
+    return pm_owner_shard(alloc_idx, total_allocs);
+}
+
+/**
+ * Find the shard that owns a page in memory. The page may be lent to another shard (see pm_steal_page).
+ *
+ * @param page_idx the page in memory.
+ * @return the owning shard.
+ */
+pm_shard_t* pm_page_shard(unsigned long page_idx) {
+    return pm_owner_shard(page_idx, heap_pages);
+}
+
+/**
+ * Find open page in the shard's page region of memory. NOTE: does not mark as used.
+ * 
+ * @param shard the shard to search.
+ * @return the page index for an unused page in memory or -1 if can't be found.
+*/
+int pm_find_page(pm_shard_t* shard) {
+    long page = pm_bitmap_find(&shard->avail_pages);
+    return page < 0 ? -1 : (int) (shard->page_base + page);
+}
+
+/**
+ * Find open page in the shard's allocation region of memory. NOTE: does not mark as used.
+ * 
+ * @param shard the shard to search.
+ * @return the index of the first page in the contiguous set of pages or -1 if can't be found.
+*/
+int pm_find_alloc(pm_shard_t* shard) {
+    long alloc = pm_bitmap_find(&shard->avail_allocs);
+    return alloc < 0 ? -1 : (int) (shard->alloc_base + alloc);
+}
+
+/**
+ * Count the pages of a shard that are in memory and can be evicted.
+ *
+ * @param shard the shard to count.
+ * @return the number of allocations on the policy's lists in memory.
+ */
+unsigned long pm_resident_count(pm_shard_t* shard) {
+    unsigned long count = 0;
+    for (int l = 0; l < policy->resident_lists; l++) {
+        count += shard->lists[l].len;
+    }
+    return count;
+}
+
+/**
+ * Borrow an open page in memory from another shard. The page stays marked as used in the owning shard
+ * until it is given back with pm_return_page. Other shards are only tried, never waited on, so this
+ * can be called with the lock of the borrowing shard held.
+ *
+ * @param shard the shard that is out of pages.
+ * @return the page index of the borrowed page or -1 if no other shard had an open page.
+ */
+int pm_steal_page(pm_shard_t* shard) {
+    for (unsigned int i = 1; i < shard_count; i++) {
+        pm_shard_t* victim = &shards[(shard - shards + i) % shard_count];
+        if (pthread_mutex_trylock(&victim->lock) != 0) {
+            continue;
+        }
+
+        // the victim keeps its last open page unless it has pages of its own to evict, so it can always
+        // bring its own allocations into memory.
+        int page_idx = pm_find_page(victim);
+        if (page_idx >= 0) {
+            pm_bitmap_set(&victim->avail_pages, page_idx - victim->page_base);
+            if (pm_resident_count(victim) == 0 && pm_find_page(victim) < 0) {
+                pm_bitmap_clear(&victim->avail_pages, page_idx - victim->page_base);
+                page_idx = -1;
+            }
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (page_idx >= 0) {
+            return page_idx;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Mark a page in memory as available in the shard that owns it.
+ *
+ * @param shard the shard whose lock is held.
+ * @param page_idx the page to release.
+ * @return true if the page was released, false if it belongs to another shard and must be given back
+ *     with pm_return_page once the lock of shard is released.
+ */
+bool pm_release_page(pm_shard_t* shard, int page_idx) {
+    if (pm_page_shard(page_idx) != shard) {
+        return false;
+    }
+
+    pm_bitmap_clear(&shard->avail_pages, page_idx - shard->page_base);
+    return true;
+}
+
+/**
+ * Give a borrowed page in memory back to the shard that owns it. Must be called without holding the
+ * lock of any other shard.
+ *
+ * @param page_idx the page to give back.
+ */
+void pm_return_page(int page_idx) {
+    pm_shard_t* owner = pm_page_shard(page_idx);
+    pm_shard_lock(owner);
+    pm_bitmap_clear(&owner->avail_pages, page_idx - owner->page_base);
+    pthread_mutex_unlock(&owner->lock);
+}
+
+/**
+ * Start changing the contents of a page in memory, or which allocation it holds. Lockless readers
+ * that overlap with the change retry under the lock.
+ *
+ * @param page_idx the page in memory.
+ */
+void pm_seq_begin(int page_idx) {
+    __atomic_store_n(&page_seqs[page_idx], page_seqs[page_idx] + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Finish a change started with pm_seq_begin.
+ *
+ * @param page_idx the page in memory.
+ */
+void pm_seq_end(int page_idx) {
+    __atomic_store_n(&page_seqs[page_idx], page_seqs[page_idx] + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Remove an allocation from the policy list it is in, if any.
+ *
+ * @param shard the shard that owns the allocation.
+ * @param page the page to remove.
+ */
+void pm_list_remove(pm_shard_t* shard, page_t* page) {
+    if (page->lru_list < 0) {
+        return;
+    }
+    pm_list_t* list = &shard->lists[page->lru_list];
+
+    if (page->lru_prev >= 0) {
+        alloc_region[page->lru_prev].lru_next = page->lru_next;
+    } else {
+        list->head = page->lru_next;
+    }
+
+    if (page->lru_next >= 0) {
+        alloc_region[page->lru_next].lru_prev = page->lru_prev;
+    } else {
+        list->tail = page->lru_prev;
+    }
+
+    list->len--;
+    page->lru_list = -1;
+    page->lru_prev = -1;
+    page->lru_next = -1;
+}
+
+/**
+ * Add an allocation to the head of a policy list.
+ *
+ * @param shard the shard that owns the allocation.
+ * @param list the index of the list in shard->lists.
+ * @param page the page to add. Must not currently be in a list.
+ */
+void pm_list_push(pm_shard_t* shard, int list, page_t* page) {
+    pm_list_t* l = &shard->lists[list];
+    page->lru_list = list;
+    page->lru_prev = -1;
+    page->lru_next = l->head;
+
+    if (l->head >= 0) {
+        alloc_region[l->head].lru_prev = page->alloc_idx;
+    } else {
+        l->tail = page->alloc_idx;
+    }
+    l->head = page->alloc_idx;
+    l->len++;
+}
+
+/**
+ * Move an allocation to the head of a policy list.
+ *
+ * @param shard the shard that owns the allocation.
+ * @param list the index of the list in shard->lists.
+ * @param page the page to move. Must currently be in a list.
+ */
+void pm_list_move(pm_shard_t* shard, int list, page_t* page) {
+    if (page->lru_list != list || shard->lists[list].head != (int) page->alloc_idx) {
+        pm_list_remove(shard, page);
+        pm_list_push(shard, list, page);
+    }
+}
+
+/**
+ * Drop the tail of a list that remembers evicted allocations.
+ *
+ * @param shard the shard that owns the list.
+ * @param list the index of the list in shard->lists.
+ */
+void pm_list_forget(pm_shard_t* shard, int list) {
+    pm_list_remove(shard, &alloc_region[shard->lists[list].tail]);
+}
+
+/**
+ * Wake the flusher up early because a shard ran short of clean pages.
+ */
+void pm_kick_flusher() {
+    pthread_mutex_lock(&flusher_lock);
+    if (!flusher_kicked) {
+        flusher_kicked = true;
+        pthread_cond_signal(&flusher_cond);
+    }
+    pthread_mutex_unlock(&flusher_lock);
+}
+
+// state of a victim search across the lists of a policy.
+struct pm_scan {
+    // coldest dirty page seen, in case there is no clean one.
+    page_t* dirty_page;
+    // number of dirty pages passed over.
+    unsigned long dirty_skipped;
+};
+typedef struct pm_scan pm_scan_t;
+
+/**
+ * Look for a page to evict in a list, from its tail. Lockless reads can't move a page between lists,
+ * so a page read since it was last moved is handed to hit instead, which moves it towards the head.
+ * When the flusher is running, a clean page is looked for so that no disk I/O is needed, and at most
+ * the shard's flush watermark of dirty pages are passed over across every list searched.
+ *
+ * @param shard the shard to search.
+ * @param list the index of the list in shard->lists.
+ * @param hit what to do with a page read since it was last moved, or NULL to ignore such reads.
+ * @param scan the state of the search.
+ * @return the page to evict, or NULL if the list has none.
+ */
+page_t* pm_list_victim(pm_shard_t* shard, int list, void (*hit)(pm_shard_t*, page_t*), pm_scan_t* scan) {
+    // pages given a second chance go ahead of where the search started, so they are searched again
+    // (with their flag cleared) if the first pass finds nothing.
+    bool second_pass = false;
+    bool any_hit = false;
+
+    int alloc_idx = shard->lists[list].tail;
+    while (alloc_idx >= 0 && scan->dirty_skipped < shard->flush_watermark) {
+        page_t* page = &alloc_region[alloc_idx];
+        int prev = page->lru_prev;
+
+        if (__atomic_exchange_n(&page->referenced, false, __ATOMIC_RELAXED) && hit) {
+            hit(shard, page);
+            any_hit = true;
+        } else if (alloc_idx == shard->flush_alloc) {
+            // being written back by the flusher, so it can't be evicted yet.
+        } else if (!flusher_running || !page->dirty) {
+            return page;
+        } else {
+            if (!scan->dirty_page) {
+                scan->dirty_page = page;
+            }
+            scan->dirty_skipped++;
+        }
+
+        alloc_idx = prev;
+        if (alloc_idx < 0 && any_hit && !second_pass) {
+            second_pass = true;
+            alloc_idx = shard->lists[list].tail;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Finish a victim search that found no clean page.
+ *
+ * @param scan the state of the search.
+ * @return the coldest dirty page seen, or NULL if every page in memory is pinned.
+ */
+page_t* pm_scan_fallback(pm_scan_t* scan) {
+    // the flusher is behind, so the dirty page has to be written back by the caller.
+    if (scan->dirty_page) {
+        pm_kick_flusher();
+    }
+
+    return scan->dirty_page;
+}
+
+/**
+ * LRU and CLOCK: every page in memory is on list 0, most recently inserted at the head.
+ */
+void pm_lru_insert(pm_shard_t* shard, page_t* page) {
+    pm_list_push(shard, 0, page);
+}
+
+/**
+ * LRU: an access moves the page to the head as the most recently used page.
+ */
+void pm_lru_access(pm_shard_t* shard, page_t* page) {
+    pm_list_move(shard, 0, page);
+
+    // the page is at the head, so it doesn't need a second chance for lockless reads.
+    __atomic_store_n(&page->referenced, false, __ATOMIC_RELAXED);
+}
+
+/**
+ * LRU and CLOCK: a page read without the lock gets a second chance at the head.
+ */
+void pm_lru_hit(pm_shard_t* shard, page_t* page) {
+    pm_list_move(shard, 0, page);
+}
+
+/**
+ * LRU and CLOCK: evict from the tail, giving referenced pages a second chance.
+ */
+page_t* pm_lru_victim(pm_shard_t* shard, page_t* incoming) {
+    (void) incoming;
+    pm_scan_t scan = { NULL, 0 };
+    page_t* page = pm_list_victim(shard, 0, pm_lru_hit, &scan);
+    return page ? page : pm_scan_fallback(&scan);
+}
+
+/**
+ * LRU, CLOCK and 2Q: an evicted page is not remembered.
+ */
+void pm_lru_evict(pm_shard_t* shard, page_t* page) {
+    pm_list_remove(shard, page);
+}
+
+/**
+ * CLOCK: an access only sets the referenced flag, like a lockless read. The victim search is the
+ * clock hand: sweeping from the tail, a referenced page has its flag cleared and goes back to the head.
+ */
+void pm_clock_access(pm_shard_t* shard, page_t* page) {
+    (void) shard;
+    if (!__atomic_load_n(&page->referenced, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&page->referenced, true, __ATOMIC_RELAXED);
+    }
+}
+
+// 2Q lists: new pages in FIFO order, pages used again after leaving it in LRU order, and the
+// allocations evicted from the FIFO recently.
+#define Q2_IN 0
+#define Q2_MAIN 1
+#define Q2_OUT 2
+
+/**
+ * 2Q: a page evicted from the FIFO recently goes straight to the LRU list when it is brought back,
+ * any other page starts in the FIFO. The history is then trimmed to half the shard's pages.
+ */
+void pm_2q_insert(pm_shard_t* shard, page_t* page) {
+    if (page->lru_list == Q2_OUT) {
+        pm_list_remove(shard, page);
+        pm_list_push(shard, Q2_MAIN, page);
+    } else {
+        pm_list_push(shard, Q2_IN, page);
+    }
+
+    unsigned long out_max = shard->page_count / 2 ? shard->page_count / 2 : 1;
+    while (shard->lists[Q2_OUT].len > out_max) {
+        pm_list_forget(shard, Q2_OUT);
+    }
+}
+
+/**
+ * 2Q: an access moves a page on the LRU list to its head. Pages in the FIFO stay where they are.
+ */
+void pm_2q_access(pm_shard_t* shard, page_t* page) {
+    if (page->lru_list == Q2_MAIN) {
+        pm_list_move(shard, Q2_MAIN, page);
+        __atomic_store_n(&page->referenced, false, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * 2Q: a page on the LRU list read without the lock gets a second chance at its head.
+ */
+void pm_2q_hit(pm_shard_t* shard, page_t* page) {
+    pm_list_move(shard, Q2_MAIN, page);
+}
+
+/**
+ * 2Q: evict from the FIFO while it holds more than a quarter of the shard's pages, otherwise from
+ * the LRU list.
+ */
+page_t* pm_2q_victim(pm_shard_t* shard, page_t* incoming) {
+    (void) incoming;
+    pm_scan_t scan = { NULL, 0 };
+    unsigned long in_max = shard->page_count / 4 ? shard->page_count / 4 : 1;
+    page_t* page;
+
+    if (shard->lists[Q2_IN].len > in_max) {
+        page = pm_list_victim(shard, Q2_IN, NULL, &scan);
+        page = page ? page : pm_list_victim(shard, Q2_MAIN, pm_2q_hit, &scan);
+    } else {
+        page = pm_list_victim(shard, Q2_MAIN, pm_2q_hit, &scan);
+        page = page ? page : pm_list_victim(shard, Q2_IN, NULL, &scan);
+    }
+
+    return page ? page : pm_scan_fallback(&scan);
+}
+
+/**
+ * 2Q: a page evicted from the FIFO is remembered, one evicted from the LRU list is not.
+ */
+void pm_2q_evict(pm_shard_t* shard, page_t* page) {
+    bool remember = page->lru_list == Q2_IN;
+    pm_list_remove(shard, page);
+    if (remember) {
+        pm_list_push(shard, Q2_OUT, page);
+    }
+}
+
+// ARC lists: pages used once and pages used more than once since they came into memory, and the
+// allocations recently evicted from each.
+#define ARC_T1 0
+#define ARC_T2 1
+#define ARC_B1 2
+#define ARC_B2 3
+
+/**
+ * ARC: bringing back a page that was evicted recently means its list was too short, so the target
+ * size of the recency list grows (evicted from T1) or shrinks (evicted from T2).
+ */
+void pm_arc_fault(pm_shard_t* shard, page_t* incoming) {
+    unsigned long b1 = shard->lists[ARC_B1].len;
+    unsigned long b2 = shard->lists[ARC_B2].len;
+
+    if (incoming->lru_list == ARC_B1) {
+        unsigned long delta = b2 > b1 ? b2 / b1 : 1;
+        shard->arc_target = shard->arc_target + delta < shard->page_count ? shard->arc_target + delta : shard->page_count;
+    } else if (incoming->lru_list == ARC_B2) {
+        unsigned long delta = b1 > b2 ? b1 / b2 : 1;
+        shard->arc_target = shard->arc_target > delta ? shard->arc_target - delta : 0;
+    }
+}
+
+/**
+ * ARC: a page evicted recently goes to the frequency list when it is brought back, any other page
+ * to the recency list. The history is then trimmed to the shard's page count per side.
+ */
+void pm_arc_insert(pm_shard_t* shard, page_t* page) {
+    if (page->lru_list == ARC_B1 || page->lru_list == ARC_B2) {
+        pm_list_remove(shard, page);
+        pm_list_push(shard, ARC_T2, page);
+    } else {
+        pm_list_push(shard, ARC_T1, page);
+    }
+
+    pm_list_t* lists = shard->lists;
+    while (lists[ARC_B1].len > 0 && lists[ARC_T1].len + lists[ARC_B1].len > shard->page_count) {
+        pm_list_forget(shard, ARC_B1);
+    }
+    while (lists[ARC_B2].len > 0
+            && lists[ARC_T1].len + lists[ARC_T2].len + lists[ARC_B1].len + lists[ARC_B2].len > 2 * shard->page_count) {
+        pm_list_forget(shard, ARC_B2);
+    }
+}
+
+/**
+ * ARC: any access moves the page to the head of the frequency list, including a read without the lock.
+ */
+void pm_arc_access(pm_shard_t* shard, page_t* page) {
+    pm_list_move(shard, ARC_T2, page);
+    __atomic_store_n(&page->referenced, false, __ATOMIC_RELAXED);
+}
+
+/**
+ * ARC: evict from the recency list while it is longer than its target, otherwise from the frequency list.
+ */
+page_t* pm_arc_victim(pm_shard_t* shard, page_t* incoming) {
+    pm_scan_t scan = { NULL, 0 };
+    unsigned long t1 = shard->lists[ARC_T1].len;
+    page_t* page;
+
+    if (t1 > 0 && (t1 > shard->arc_target || (incoming && incoming->lru_list == ARC_B2 && t1 == shard->arc_target))) {
+        page = pm_list_victim(shard, ARC_T1, pm_arc_access, &scan);
+        page = page ? page : pm_list_victim(shard, ARC_T2, pm_arc_access, &scan);
+    } else {
+        page = pm_list_victim(shard, ARC_T2, pm_arc_access, &scan);
+        page = page ? page : pm_list_victim(shard, ARC_T1, pm_arc_access, &scan);
+    }
+
+    return page ? page : pm_scan_fallback(&scan);
+}
+
+/**
+ * ARC: an evicted page is remembered on the history list of the list it was evicted from.
+ */
+void pm_arc_evict(pm_shard_t* shard, page_t* page) {
+    int history = page->lru_list == ARC_T1 ? ARC_B1 : ARC_B2;
+    pm_list_remove(shard, page);
+    pm_list_push(shard, history, page);
+}
+
+// replacement policies, indexed by pm_policy_t.
+static const pm_policy_ops_t policies[] = {
+    [PM_POLICY_LRU] = { 1, NULL, pm_lru_insert, pm_lru_access, pm_lru_victim, pm_lru_evict },
+    [PM_POLICY_CLOCK] = { 1, NULL, pm_lru_insert, pm_clock_access, pm_lru_victim, pm_lru_evict },
+    [PM_POLICY_2Q] = { 2, NULL, pm_2q_insert, pm_2q_access, pm_2q_victim, pm_2q_evict },
+    [PM_POLICY_ARC] = { 2, pm_arc_fault, pm_arc_insert, pm_arc_access, pm_arc_victim, pm_arc_evict },
+};
+
+/**
+ * FNV-1a hash of the bytes of the metadata file.
+ *
+ * @param hash the hash so far, or the FNV offset basis to start.
+ * @param data the bytes to hash.
+ * @param len the number of bytes.
+ * @return the hash including data.
+ */
+uint64_t pm_meta_checksum(uint64_t hash, const void* data, unsigned long len) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    for (unsigned long i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Make the entries of the disk directory durable, after a file in it was renamed or removed.
+ *
+ * @return true if the directory was synced.
+ */
+bool pm_sync_dir() {
+    int fd = open(disk_dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+/**
+ * Remove the saved metadata, before the swap file it describes is changed.
+ */
+void pm_meta_invalidate() {
+    pthread_mutex_lock(&meta_lock);
+    if (meta_saved) {
+        if (unlink(meta_filename) != 0 && errno != ENOENT) {
+            printf("Error pm_meta_invalidate(): unable to remove %s.\n", meta_filename);
+        }
+        pm_sync_dir();
+        __atomic_store_n(&meta_saved, false, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&meta_lock);
+}
+
+/**
+ * Save the allocation table and swap slots to the metadata file. The file is written under a temporary
+ * name, synced and renamed over the old one, so a crash leaves either the old file or the new one.
+ * Every shard's lock must be held, and the swap file must already hold every allocation's contents.
+ *
+ * @return true if the metadata was saved.
+ */
+bool pm_meta_save() {
+    unsigned long bytes = sizeof(pm_meta_header_t) + total_allocs * sizeof(int32_t);
+    char* buf = malloc(bytes);
+    if (!buf) {
+        printf("Error pm_meta_save(): unable to allocate %lu bytes.\n", bytes);
+        return false;
+    }
+
+    pm_meta_header_t* header = (pm_meta_header_t*) buf;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, META_MAGIC, sizeof(header->magic));
+    header->page_size = page_size;
+    header->allocs = total_allocs;
+    header->shards = shard_count;
+    int32_t* slots = (int32_t*) (buf + sizeof(pm_meta_header_t));
+    for (unsigned int s = 0; s < shard_count; s++) {
+        pm_shard_t* shard = &shards[s];
+        for (unsigned long a = 0; a < shard->alloc_count; a++) {
+            bool used = ((shard->avail_allocs.words[a / 64] >> (a % 64)) & 1)
+                && !__atomic_load_n(&alloc_region[shard->alloc_base + a].cached, __ATOMIC_RELAXED);
+            slots[shard->alloc_base + a] = used ? alloc_region[shard->alloc_base + a].swap_slot : META_FREE;
+        }
+    }
+    header->checksum = pm_meta_checksum(14695981039346656037ULL, buf, bytes);
+
+    char tmp_filename[PATH_MAX + 4];
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", meta_filename);
+    int fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    unsigned long done = 0;
+    while (fd >= 0 && done < bytes) {
+        ssize_t n = write(fd, buf + done, bytes - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    free(buf);
+
+    bool saved = fd >= 0 && done == bytes && fsync(fd) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!saved || rename(tmp_filename, meta_filename) != 0 || !pm_sync_dir()) {
+        printf("Error pm_meta_save(): unable to write %s.\n", meta_filename);
+        unlink(tmp_filename);
+        return false;
+    }
+
+    __atomic_store_n(&meta_saved, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Reattach the allocations saved in the metadata file. Nothing is changed unless the whole file is valid
+ * and was saved by a heap with the same geometry. The allocations stay on disk until they are accessed.
+ *
+ * @return true if the allocations were reattached, false if the heap starts empty.
+ */
+bool pm_meta_load() {
+    int fd = open(meta_filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    unsigned long bytes = sizeof(pm_meta_header_t) + total_allocs * sizeof(int32_t);
+    char* buf = malloc(bytes);
+    struct stat st;
+    bool read_all = buf && fstat(fd, &st) == 0 && (unsigned long) st.st_size == bytes;
+    unsigned long done = 0;
+    while (read_all && done < bytes) {
+        ssize_t n = read(fd, buf + done, bytes - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            read_all = false;
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+    if (!read_all) {
+        printf("Error pm_meta_load(): %s doesn't match the heap's geometry, starting empty.\n", meta_filename);
+        free(buf);
+        return false;
+    }
+
+    // the header must match this heap, the checksum every byte, and the swap file must still hold every slot.
+    pm_meta_header_t* header = (pm_meta_header_t*) buf;
+    uint64_t checksum = header->checksum;
+    header->checksum = 0;
+    bool valid = stat(swap_filename, &st) == 0 && (unsigned long) st.st_size >= total_allocs * page_size
+        && memcmp(header->magic, META_MAGIC, sizeof(header->magic)) == 0 && header->page_size == page_size
+        && header->allocs == total_allocs && header->shards == shard_count
+        && pm_meta_checksum(14695981039346656037ULL, buf, bytes) == checksum;
+
+    // every slot must be in its allocation's shard.
+    int32_t* slots = (int32_t*) (buf + sizeof(pm_meta_header_t));
+    for (unsigned int s = 0; valid && s < shard_count; s++) {
+        pm_shard_t* shard = &shards[s];
+        for (unsigned long a = shard->alloc_base; valid && a < shard->alloc_base + shard->alloc_count; a++) {
+            valid = slots[a] == META_FREE || slots[a] == -1
+                || (slots[a] >= (int32_t) shard->alloc_base && slots[a] < (int32_t) (shard->alloc_base + shard->alloc_count));
+        }
+    }
+    if (!valid) {
+        printf("Error pm_meta_load(): %s is invalid or from another heap, starting empty.\n", meta_filename);
+        free(buf);
+        return false;
+    }
+
+    for (unsigned int s = 0; s < shard_count; s++) {
+        pm_shard_t* shard = &shards[s];
+        for (unsigned long a = shard->alloc_base; a < shard->alloc_base + shard->alloc_count; a++) {
+            if (slots[a] == META_FREE) {
+                continue;
+            }
+            alloc_region[a] = (page_t) { a, -1, false, -1, -1, -1, slots[a], 0, false, false, false };
+            pm_bitmap_set(&shard->avail_allocs, a - shard->alloc_base);
+            if (slots[a] >= 0) {
+                pm_bitmap_set(&shard->avail_slots, slots[a] - shard->alloc_base);
+                slot_refs[slots[a]]++;
+            }
+        }
+    }
+
+    free(buf);
+    return true;
+}
+
+/**
+ * Lock every shard in order, waiting for the flusher to finish a write back it is doing without a
+ * shard's lock. The caller then has the swap file to itself.
+ */
+void pm_lock_all() {
+    for (unsigned int s = 0; s < shard_count; s++) {
+        pm_shard_lock(&shards[s]);
+
+        // the flusher needs the shard's lock to finish its write.
+        while (shards[s].flush_alloc >= 0) {
+            pthread_cond_wait(&shards[s].flush_done, &shards[s].lock);
+        }
+    }
+}
+
+/**
+ * Number of buckets in the dedup table of a shard: the least power of two that is at least its number of slots.
+ *
+ * @param slots the number of swap slots of the shard.
+ * @return the number of buckets.
+ */
+unsigned long pm_dedup_buckets(unsigned long slots) {
+    unsigned long buckets = 1;
+    while (buckets < slots) {
+        buckets <<= 1;
+    }
+    return buckets;
+}
+
+/**
+ * Hash the contents of a page, a 64-bit word at a time.
+ *
+ * @param bytes the page's bytes.
+ * @return the hash of the page.
+ */
+uint64_t pm_page_hash(const char* bytes) {
+    uint64_t hash = page_size;
+    unsigned long i = 0;
+    for (; i + sizeof(uint64_t) <= page_size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < page_size; i++) {
+        hash = (hash ^ (unsigned char) bytes[i]) * 1099511628211ULL;
+    }
+    return hash ^ (hash >> 32);
+}
+
+/**
+ * Add a swap slot to its shard's dedup table, once it holds the page with the given hash.
+ *
+ * @param shard the shard that owns the slot.
+ * @param slot the swap slot. Must not be in the table.
+ * @param hash the hash of the slot's contents.
+ */
+void pm_dedup_add(pm_shard_t* shard, int slot, uint64_t hash) {
+    int* bucket = &shard->dedup_buckets[hash & shard->dedup_mask];
+    slot_hashes[slot] = hash;
+    dedup_next[slot] = *bucket;
+    *bucket = slot;
+}
+
+/**
+ * Take a swap slot out of its shard's dedup table, before its contents change or it is released.
+ *
+ * @param shard the shard that owns the slot.
+ * @param slot the swap slot. Nothing is done if it isn't in the table.
+ */
+void pm_dedup_remove(pm_shard_t* shard, int slot) {
+    if (!dedup || dedup_next[slot] == DEDUP_NONE) {
+        return;
+    }
+
+    int* link = &shard->dedup_buckets[slot_hashes[slot] & shard->dedup_mask];
+    while (*link != slot) {
+        link = &dedup_next[*link];
+    }
+    *link = dedup_next[slot];
+    dedup_next[slot] = DEDUP_NONE;
+}
+
+/**
+ * Release the swap slot of an allocation, if it has one. A slot shared with identical pages is kept for
+ * them. Otherwise the stale contents on disk are simply overwritten by the next owner. If the flusher is
+ * writing the page back, the slot is released once the write is done.
+ *
+ * @param shard the shard that owns the allocation.
+ * @param page the allocation.
+ */
+void pm_release_slot(pm_shard_t* shard, page_t* page) {
+    int slot = page->swap_slot;
+    if (slot < 0) {
+        return;
+    }
+
+    page->swap_slot = -1;
+    if (--slot_refs[slot] > 0) {
+        return;
+    }
+    pm_dedup_remove(shard, slot);
+    if (shard->flush_alloc == (int) page->alloc_idx) {
+        shard->flush_slot_freed = true;
+    } else {
+        pm_bitmap_clear(&shard->avail_slots, slot - shard->alloc_base);
+    }
+}
+
+/**
+ * Determine if a page holds only '\0'.
+ *
+ * @param bytes the page's bytes.
+ * @return true if every byte is '\0'.
+ */
+bool pm_zero_bytes(const char* bytes) {
+    return bytes[0] == '\0' && memcmp(bytes, bytes + 1, page_size - 1) == 0;
+}
+
+/**
+ * Determine if an allocation that isn't in memory holds only '\0': it has no copy in its swap slot or in
+ * the compressed pool, since it was never written or only held '\0' when it was last evicted.
+ *
+ * @param page the allocation.
+ * @return true if the allocation isn't in memory and holds only '\0'.
+ */
+bool pm_zero_alloc(page_t* page) {
+    return page->page_idx < 0 && page->swap_slot < 0 && !(zpool_bytes && zentries[page->alloc_idx].chunk >= 0);
+}
+
+/**
+ * Take over the swap slot of an allocation freed while the flusher writes it back, once the write is done.
+ * An allocation holds at most one slot, so a shard only runs out of free slots while the release of that
+ * slot is deferred. The shard's lock must be held.
+ *
+ * @param shard the shard with no free slot.
+ * @return the slot, relative to the shard's alloc_base, which stays marked as used, or -1 if no release is
+ *     deferred.
+ */
+long pm_flush_slot_take(pm_shard_t* shard) {
+    if (shard->flush_alloc < 0 || !shard->flush_slot_freed || shard->flush_slot < 0) {
+        printf("Error pm_swap_slot(): no swap slot left in shard %ld.\n", (long) (shard - shards));
+        return -1;
+    }
+
+    pthread_mutex_lock(&flusher_lock);
+    while (!shard->flush_written) {
+        pthread_cond_wait(&flush_write_cond, &flusher_lock);
+    }
+    pthread_mutex_unlock(&flusher_lock);
+
+    long slot = shard->flush_slot - shard->alloc_base;
+    shard->flush_slot = -1;
+    return slot;
+}
+
+/**
+ * Swap slot of an allocation, for writing the page to it. The first write of an allocation claims a slot,
+ * which it keeps until pm_free. A page that shares its slot with identical pages is copied on write: it
+ * leaves the slot to them and claims one of its own. A new slot holds nothing of the page, so the whole page
+ * in memory is marked dirty. If the shard has no free slot, this waits for the flusher's write back.
+ *
+ * @param shard the shard that owns the allocation.
+ * @param page the allocation.
+ * @return the allocation's swap slot, or -1 if the shard has none left for it.
+ */
+int pm_swap_slot(pm_shard_t* shard, page_t* page) {
+    if (page->swap_slot >= 0 && slot_refs[page->swap_slot] > 1) {
+        slot_refs[page->swap_slot]--;
+        page->swap_slot = -1;
+        PM_STAT_ADD(dedup_copies, 1);
+    }
+
+    if (page->swap_slot < 0) {
+        long slot = pm_bitmap_find(&shard->avail_slots);
+        if (slot < 0) {
+            slot = pm_flush_slot_take(shard);
+            if (slot < 0) {
+                return -1;
+            }
+        } else {
+            pm_bitmap_set(&shard->avail_slots, slot);
+        }
+        page->swap_slot = shard->alloc_base + slot;
+        slot_refs[page->swap_slot] = 1;
+        if (page->page_idx >= 0) {
+            dirty_blocks[page->page_idx] = dirty_all;
+        }
+    } else {
+        // the slot's contents are about to change.
+        pm_dedup_remove(shard, page->swap_slot);
+    }
+
+    return page->swap_slot;
+}
+
+/**
+ * Read or write part of a page at a slot of the swap file with positional I/O.
+ *
+ * @param write true to write buf to the slot, false to read the slot into buf.
+ * @param buf the bytes of the range.
+ * @param slot the swap slot.
+ * @param off the position of the range in the page.
+ * @param len the number of bytes in the range.
+ * @return true if the whole range was transferred.
+ */
+bool pm_swap_range(bool write, char* buf, int slot, unsigned long off, unsigned long len) {
+    // the saved metadata describes the swap file as it was, so it goes before the file changes.
+    if (write && __atomic_load_n(&meta_saved, __ATOMIC_ACQUIRE)) {
+        pm_meta_invalidate();
+    }
+
+    off_t offset = (off_t) slot * page_size + off;
+    unsigned long done = 0;
+    unsigned long start = pm_now_ns();
+
+    // the kernel reads and writes back the mapping. The slot is cold either way once it's copied: it
+    // was just evicted, or its page is now in memory. Dropping the mapping keeps the slot in the page
+    // cache, but stops copies of it adding up in this process.
+    if (swap_map) {
+        if (write) {
+            memcpy(swap_map + offset, buf, len);
+        } else {
+            memcpy(buf, swap_map + offset, len);
+        }
+        if (swap_drop) {
+            madvise(swap_map + (off_t) slot * page_size, page_size, MADV_DONTNEED);
+        }
+        done = len;
+    }
+
+    while (done < len) {
+        ssize_t n = write
+            ? pwrite(swap_fd, buf + done, len - done, offset + done)
+            : pread(swap_fd, buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+
+    PM_STAT_ADD(io_ns, pm_now_ns() - start);
+    if (write) {
+        PM_STAT_ADD(disk_writes, 1);
+        PM_STAT_ADD(bytes_written, done);
+        PM_STAT_ADD(write_calls, 1);
+    } else {
+        PM_STAT_ADD(disk_reads, 1);
+        PM_STAT_ADD(bytes_read, done);
+    }
+
+    return done == len;
+}
+
+/**
+ * Read or write a whole page at a slot of the swap file with positional I/O.
+ *
+ * @param write true to write buf to the slot, false to read the slot into buf.
+ * @param buf the page contents.
+ * @param slot the swap slot.
+ * @return true if the whole page was transferred.
+ */
+bool pm_swap_io(bool write, char* buf, int slot) {
+    return pm_swap_range(write, buf, slot, 0, page_size);
+}
+
+/**
+ * Write the dirty blocks of a page to its swap slot, with a write for every run of them. The rest of the
+ * slot must already hold the rest of the page.
+ *
+ * @param buf the page contents.
+ * @param slot the swap slot.
+ * @param blocks the page's dirty blocks.
+ * @return true if every dirty block was written.
+ */
+bool pm_swap_write_blocks(char* buf, int slot, uint64_t blocks) {
+    if ((blocks & dirty_all) == dirty_all) {
+        return pm_swap_io(true, buf, slot);
+    }
+
+    bool written = true;
+    unsigned long skipped = page_size;
+    for (unsigned long b = 0; b < dirty_block_count; ) {
+        if (!((blocks >> b) & 1)) {
+            b++;
+            continue;
+        }
+        unsigned long run = 1;
+        while (b + run < dirty_block_count && ((blocks >> (b + run)) & 1)) {
+            run++;
+        }
+
+        // the last block may be cut short by the end of the page.
+        unsigned long off = b * dirty_block_size;
+        unsigned long len = run * dirty_block_size < page_size - off ? run * dirty_block_size : page_size - off;
+        written = pm_swap_range(true, buf + off, slot, off, len) && written;
+        skipped -= len;
+        b += run;
+    }
+
+    PM_STAT_ADD(bytes_skipped, skipped);
+    return written;
+}
+
+/**
+ * Find a swap slot of a shard that holds the same bytes as a page. Slots with the same hash are read back
+ * and compared, so a hash collision is never mistaken for a match.
+ *
+ * @param shard the shard to search.
+ * @param bytes the page's bytes.
+ * @param hash the hash of the page (see pm_page_hash).
+ * @return the slot or -1 if no slot in the shard's table holds the page.
+ */
+int pm_dedup_find(pm_shard_t* shard, const char* bytes, uint64_t hash) {
+    for (int slot = shard->dedup_buckets[hash & shard->dedup_mask]; slot >= 0; slot = dedup_next[slot]) {
+        if (slot_hashes[slot] == hash && pm_swap_io(false, shard->dedup_scratch, slot)
+                && memcmp(shard->dedup_scratch, bytes, page_size) == 0) {
+            return slot;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Let an evicted dirty page share the swap slot of an identical page in its shard, instead of being written.
+ *
+ * @param shard the shard that owns the allocation.
+ * @param page the page being evicted. Must still be in memory.
+ * @param hash set to the hash of the page, to add its slot to the table once it is written.
+ * @return true if the page now shares a slot that holds it.
+ */
+bool pm_dedup_page(pm_shard_t* shard, page_t* page, uint64_t* hash) {
+    char* bytes = &pm_heap[page->page_idx * page_size];
+    *hash = pm_page_hash(bytes);
+    int slot = pm_dedup_find(shard, bytes, *hash);
+    if (slot < 0) {
+        return false;
+    }
+
+    // the page may already be in that slot, if it was changed back to what was last written.
+    if (slot != page->swap_slot) {
+        pm_release_slot(shard, page);
+        page->swap_slot = slot;
+        slot_refs[slot]++;
+    }
+    PM_STAT_ADD(dedup_hits, 1);
+    return true;
+}
+
+/**
+ * Mark a range of a page in memory as changed.
+ *
+ * @param page the page. Must be in memory, with its shard's lock held.
+ * @param off the position of the first byte changed.
+ * @param len the number of bytes changed.
+ */
+void pm_mark_dirty(page_t* page, unsigned long off, unsigned long len) {
+    page->dirty = true;
+    if (len == 0) {
+        return;
+    }
+
+    unsigned long first = off / dirty_block_size;
+    unsigned long count = (off + len - 1) / dirty_block_size - first + 1;
+    dirty_blocks[page->page_idx] |= (count == 64 ? ~0ULL : (1ULL << count) - 1) << first;
+}
+
+/**
+ * Take an allocation out of the compressed pool and release its chunks.
+ *
+ * @param shard the shard that owns the allocation.
+ * @param alloc_idx the allocation. Must be in the pool.
+ */
+void pm_zpool_remove(pm_shard_t* shard, int alloc_idx) {
+    pm_zentry_t* entry = &zentries[alloc_idx];
+
+    if (entry->prev >= 0) {
+        zentries[entry->prev].next = entry->next;
+    } else {
+        shard->zhead = entry->next;
+    }
+    if (entry->next >= 0) {
+        zentries[entry->next].prev = entry->prev;
+    } else {
+        shard->ztail = entry->prev;
+    }
+
+    for (int chunk = entry->chunk; chunk >= 0; chunk = zchunk_next[chunk]) {
+        pm_bitmap_clear(&shard->avail_zchunks, chunk - shard->zchunk_base);
+        shard->zchunks_free++;
+    }
+    entry->chunk = -1;
+    entry->prev = -1;
+    entry->next = -1;
+}
+
+/**
+ * Decompress an allocation's page from the compressed pool.
+ *
+ * @param shard the shard that owns the allocation.
+ * @param alloc_idx the allocation. Must be in the pool.
+ * @param dst where to write the page_size bytes of the page.
+ * @return true if the page was decompressed, false if its compressed bytes are corrupt.
+ */
+bool pm_zpool_read(pm_shard_t* shard, int alloc_idx, char* dst) {
+    pm_zentry_t* entry = &zentries[alloc_idx];
+
+    // gather the chain of chunks into one buffer for the decompressor.
+    char* compressed = shard->zscratch + page_size;
+    unsigned long copied = 0;
+    for (int chunk = entry->chunk; chunk >= 0; chunk = zchunk_next[chunk]) {
+        unsigned long n = entry->len - copied < ZPOOL_CHUNK ? entry->len - copied : ZPOOL_CHUNK;
+        memcpy(compressed + copied, &zchunks[(unsigned long) chunk * ZPOOL_CHUNK], n);
+        copied += n;
+    }
+
+    return pm_lz_decompress(compressed, entry->len, dst, page_size);
+}
+
+/**
+ * Make room in the compressed pool by writing its oldest page to the allocation's swap slot.
+ *
+ * @param shard the shard whose pool is full. Its pool must not be empty.
+ */
+void pm_zpool_write_back(pm_shard_t* shard) {
+    int alloc_idx = shard->ztail;
+    page_t* page = &alloc_region[alloc_idx];
+    char* buf = shard->zscratch + 2 * page_size;
+
+    int slot = pm_swap_slot(shard, page);
+    if (slot < 0 || !pm_zpool_read(shard, alloc_idx, buf) || !pm_swap_io(true, buf, slot)) {
+        printf("Error pm_zpool_write_back(): unable to write contents to disk for page %d\n", alloc_idx);
+    } else if (dedup) {
+        pm_dedup_add(shard, slot, pm_page_hash(buf));
+    }
+    PM_STAT_ADD(pool_write_backs, 1);
+    pm_zpool_remove(shard, alloc_idx);
+}
+
+/**
+ * Compress an evicted page into the shard's pool, writing the oldest pages in the pool to disk if
+ * there isn't room for it.
+ *
+ * @param shard the shard that owns the allocation.
+ * @param page the page being evicted. Must still be in memory.
+ * @return true if the page was stored, false if it doesn't compress to fewer chunks than a page takes
+ *     or is larger than the whole pool, and has to be written to disk.
+ */
+bool pm_zpool_store(pm_shard_t* shard, page_t* page) {
+    // only worth storing if it saves at least a chunk.
+    unsigned long page_chunks = (page_size + ZPOOL_CHUNK - 1) / ZPOOL_CHUNK;
+    if (page_chunks < 2) {
+        return false;
+    }
+    char* compressed = shard->zscratch;
+    unsigned long len = pm_lz_compress(&pm_heap[page->page_idx * page_size], page_size, compressed,
+        (page_chunks - 1) * ZPOOL_CHUNK);
+    unsigned long needed = (len + ZPOOL_CHUNK - 1) / ZPOOL_CHUNK;
+    if (len == 0 || needed > shard->zchunk_count) {
+        return false;
+    }
+
+    while (shard->zchunks_free < needed) {
+        pm_zpool_write_back(shard);
+    }
+
+    // copy into a chain of free chunks, which don't need to be contiguous.
+    pm_zentry_t* entry = &zentries[page->alloc_idx];
+    int* link = &entry->chunk;
+    for (unsigned long copied = 0; copied < len; copied += ZPOOL_CHUNK) {
+        long chunk = pm_bitmap_find(&shard->avail_zchunks);
+        pm_bitmap_set(&shard->avail_zchunks, chunk);
+        chunk += shard->zchunk_base;
+
+        unsigned long n = len - copied < ZPOOL_CHUNK ? len - copied : ZPOOL_CHUNK;
+        memcpy(&zchunks[chunk * ZPOOL_CHUNK], compressed + copied, n);
+        *link = (int) chunk;
+        link = &zchunk_next[chunk];
+    }
+    *link = -1;
+    shard->zchunks_free -= needed;
+    entry->len = len;
+
+    // newest page in the pool.
+    entry->prev = -1;
+    entry->next = shard->zhead;
+    if (shard->zhead >= 0) {
+        zentries[shard->zhead].prev = page->alloc_idx;
+    } else {
+        shard->ztail = page->alloc_idx;
+    }
+    shard->zhead = page->alloc_idx;
+
+    PM_STAT_ADD(pool_stores, 1);
+    return true;
+}
+
+/**
+ * Order pages by swap slot, for qsort.
+ *
+ * @param a a page_t**.
+ * @param b a page_t**.
+ * @return < 0, 0 or > 0 as a's slot is before, the same as or after b's.
+ */
+int pm_cmp_slot(const void* a, const void* b) {
+    int slot_a = (*(page_t* const*) a)->swap_slot;
+    int slot_b = (*(page_t* const*) b)->swap_slot;
+    return (slot_a > slot_b) - (slot_a < slot_b);
+}
+
+/**
+ * Order pointers by address, for qsort.
+ *
+ * @param a a page_t**.
+ * @param b a page_t**.
+ * @return < 0, 0 or > 0 as a is before, the same as or after b.
+ */
+int pm_cmp_ptr(const void* a, const void* b) {
+    uintptr_t ptr_a = (uintptr_t) *(page_t* const*) a;
+    uintptr_t ptr_b = (uintptr_t) *(page_t* const*) b;
+    return (ptr_a > ptr_b) - (ptr_a < ptr_b);
+}
+
+/**
+ * Write pages in memory to their swap slots, which must be consecutive, with a single pwritev.
+ * Falls back to a write per page if the mapping is used or the pwritev is cut short.
+ *
+ * @param pages the pages, in order of swap slot.
+ * @param count the number of pages. At most WRITE_RUN_MAX.
+ * @return true if every page was written.
+ */
+bool pm_swap_writev(page_t** pages, int count) {
+    if (swap_map || count == 1) {
+        bool written = true;
+        for (int i = 0; i < count; i++) {
+            written = pm_swap_io(true, &pm_heap[pages[i]->page_idx * page_size], pages[i]->swap_slot) && written;
+        }
+        return written;
+    }
+
+    // the saved metadata describes the swap file as it was, so it goes before the file changes.
+    if (__atomic_load_n(&meta_saved, __ATOMIC_ACQUIRE)) {
+        pm_meta_invalidate();
+    }
+
+    struct iovec iov[count];
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = &pm_heap[pages[i]->page_idx * page_size];
+        iov[i].iov_len = page_size;
+    }
+
+    unsigned long start = pm_now_ns();
+    ssize_t n;
+    do {
+        n = pwritev(swap_fd, iov, count, (off_t) pages[0]->swap_slot * page_size);
+    } while (n < 0 && errno == EINTR);
+    PM_STAT_ADD(io_ns, pm_now_ns() - start);
+
+    // finish the pages the write didn't, one at a time.
+    int done = n > 0 ? (int) (n / page_size) : 0;
+    PM_STAT_ADD(disk_writes, done);
+    PM_STAT_ADD(bytes_written, (unsigned long) done * page_size);
+    PM_STAT_ADD(write_calls, 1);
+    bool written = true;
+    for (int i = done; i < count; i++) {
+        written = pm_swap_io(true, &pm_heap[pages[i]->page_idx * page_size], pages[i]->swap_slot) && written;
+    }
+    return written;
+}
+
+/**
+ * Read pages from their swap slots into their pages in memory, a read per page. A page that can't be read
+ * holds only '\0', as it does after a failed fault.
+ *
+ * @param pages the pages.
+ * @param count the number of pages.
+ * @return true if every page was read.
+ */
+bool pm_swap_read_each(page_t** pages, int count) {
+    bool read = true;
+    for (int i = 0; i < count; i++) {
+        char* buf = &pm_heap[pages[i]->page_idx * page_size];
+        if (!pm_swap_io(false, buf, pages[i]->swap_slot)) {
+            memset(buf, '\0', page_size);
+            read = false;
+        }
+    }
+    return read;
+}
+
+/**
+ * Read pages from their swap slots, which must be consecutive, into their pages in memory with a single
+ * preadv. Falls back to a read per page if the mapping is used or the preadv is cut short.
+ *
+ * @param pages the pages, in order of swap slot.
+ * @param count the number of pages. At most READAHEAD_MAX.
+ * @return true if every page was read. Pages that couldn't be read hold only '\0'.
+ */
+bool pm_swap_readv(page_t** pages, int count) {
+    if (swap_map || count == 1) {
+        return pm_swap_read_each(pages, count);
+    }
+
+    struct iovec iov[count];
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = &pm_heap[pages[i]->page_idx * page_size];
+        iov[i].iov_len = page_size;
+    }
+
+    unsigned long start = pm_now_ns();
+    ssize_t n;
+    do {
+        n = preadv(swap_fd, iov, count, (off_t) pages[0]->swap_slot * page_size);
+    } while (n < 0 && errno == EINTR);
+    PM_STAT_ADD(io_ns, pm_now_ns() - start);
+
+    // finish the pages the read didn't, one at a time.
+    int done = n > 0 ? (int) (n / page_size) : 0;
+    PM_STAT_ADD(disk_reads, done);
+    PM_STAT_ADD(bytes_read, (unsigned long) done * page_size);
+    return pm_swap_read_each(&pages[done], count - done);
+}
+
+/**
+ * Save pages that the policy has stopped tracking to disk, and free their pages in memory. Dirty pages
+ * that don't go to the compressed pool are written in order of swap slot, with a single write for every
+ * run of consecutive slots. A page whose slot holds all but some of its blocks only has those written.
+ * With pm_config_t.dedup, a page identical to one already in a swap slot shares that slot instead, and
+ * the slots written are added to the shard's dedup table.
+ *
+ * @param shard the shard that owns the allocations.
+ * @param pages the pages to save. Reordered.
+ * @param count the number of pages.
+ */
+void pm_write_out(pm_shard_t* shard, page_t** pages, int count) {
+    // if a page isn't dirty, the copy in its swap slot is current and doesn't need to be rewritten. A dirty
+    // page holding only '\0' isn't stored at all: it gives up its slot and is faulted back in as '\0'. Any
+    // other dirty page shares the slot of an identical page if dedup finds one, or goes to the compressed
+    // pool if it has one and the page compresses, and reaches the disk only once the pool overflows. A page
+    // freed into a thread's cache is never read again. The whole pages to write are moved to the front.
+    unsigned long start = pm_now_ns();
+    int writes = 0;
+    for (int i = 0; i < count; i++) {
+        page_t* page = pages[i];
+        PM_STAT_ADD(evictions, 1);
+        if (page->dirty) {
+            PM_STAT_ADD(dirty_evictions, 1);
+        } else {
+            PM_STAT_ADD(clean_evictions, 1);
+        }
+
+        bool freed = __atomic_load_n(&page->cached, __ATOMIC_RELAXED);
+        uint64_t hash = 0;
+        if (page->dirty && !freed && pm_zero_bytes(&pm_heap[page->page_idx * page_size])) {
+            pm_release_slot(shard, page);
+            PM_STAT_ADD(zero_evictions, 1);
+        } else if (page->dirty && !freed && dedup && pm_dedup_page(shard, page, &hash)) {
+            // shares the slot of an identical page, so nothing is written.
+        } else if (page->dirty && !freed && !(zpool_bytes && pm_zpool_store(shard, page))) {
+            int slot = pm_swap_slot(shard, page);
+            uint64_t blocks = dirty_blocks[page->page_idx];
+            if (slot < 0) {
+                printf("Error pm_page_out(): unable to write contents to disk for page %d\n", page->alloc_idx);
+            } else if ((blocks & dirty_all) == dirty_all) {
+                // the slot joins the dedup table once the write is done.
+                if (dedup) {
+                    slot_hashes[slot] = hash;
+                }
+                pages[i] = pages[writes];
+                pages[writes++] = page;
+            } else if (!pm_swap_write_blocks(&pm_heap[page->page_idx * page_size], slot, blocks)) {
+                printf("Error pm_page_out(): unable to write contents to disk for page %d\n", page->alloc_idx);
+            } else if (dedup) {
+                pm_dedup_add(shard, slot, hash);
+            }
+        }
+    }
+
+    // write page contents to disk.
+    qsort(pages, writes, sizeof(page_t*), pm_cmp_slot);
+    for (int first = 0; first < writes; ) {
+        int run = 1;
+        while (first + run < writes && run < WRITE_RUN_MAX && pages[first + run]->swap_slot == pages[first]->swap_slot + run) {
+            run++;
+        }
+        if (!pm_swap_writev(&pages[first], run)) {
+            printf("Error pm_page_out(): unable to write contents to disk for pages %d to %d\n",
+                pages[first]->alloc_idx, pages[first + run - 1]->alloc_idx);
+        } else if (dedup) {
+            for (int i = first; i < first + run; i++) {
+                pm_dedup_add(shard, pages[i]->swap_slot, slot_hashes[pages[i]->swap_slot]);
+            }
+        }
+        first += run;
+    }
+
+    // reset pages in memory and fields for these allocations.
+    for (int i = 0; i < count; i++) {
+        int page_idx = pages[i]->page_idx;
+        pm_trace(PM_TRACE_EVICT, pages[i]->alloc_idx, page_idx, pages[i]->dirty ? PM_TRACE_DIRTY : 0, start);
+        pm_seq_begin(page_idx);
+        memset(&pm_heap[page_idx * page_size], '\0', page_size);
+        pages[i]->dirty = false;
+        dirty_blocks[page_idx] = 0;
+        __atomic_store_n(&pages[i]->prefetched, false, __ATOMIC_RELAXED);
+        __atomic_store_n(&pages[i]->page_idx, -1, __ATOMIC_RELAXED);
+        pm_seq_end(page_idx);
+    }
+}
+
+/**
+ * Save page to disk.
+ *
+ * @param shard the shard that owns the allocation.
+ * @param page_to_evict the page to save.
+ */
+void pm_page_out(pm_shard_t* shard, page_t* page_to_evict) {
+    // page is leaving memory, so the policy stops tracking it as a page in memory.
+    policy->evict(shard, page_to_evict);
+    pm_write_out(shard, &page_to_evict, 1);
+}
+
+/**
+ * Evict a shard's victim along with the pages the policy would evict after it, up to evict_batch pages and
+ * half of the shard's pages in memory, so the dirty ones are written together by pm_write_out. The victim's
+ * page stays marked as used, and the others are left open. Stops at a page borrowed from another shard,
+ * which can only be given back once the shard's lock is released.
+ *
+ * @param shard the shard that needs a page.
+ * @param incoming the allocation the page is for, or NULL.
+ * @param victim the page the policy chose to evict.
+ */
+void pm_page_out_batch(pm_shard_t* shard, page_t* incoming, page_t* victim) {
+    page_t* pages[EVICT_BATCH_MAX];
+    int page_idxs[EVICT_BATCH_MAX];
+    unsigned long max = pm_resident_count(shard) / 2;
+    max = max < evict_batch ? max : evict_batch;
+
+    // each page leaves the policy's lists before the next victim is chosen.
+    int count = 0;
+    while (victim) {
+        policy->evict(shard, victim);
+        page_idxs[count] = victim->page_idx;
+        pages[count++] = victim;
+        if ((unsigned long) count >= max) {
+            break;
+        }
+        victim = policy->victim(shard, incoming);
+        if (victim && (victim->page_idx < (int) shard->page_base || victim->page_idx >= (int) (shard->page_base + shard->page_count))) {
+            break;
+        }
+    }
+    pm_write_out(shard, pages, count);
+
+    for (int i = 1; i < count; i++) {
+        pm_bitmap_clear(&shard->avail_pages, page_idxs[i] - shard->page_base);
+    }
+    PM_STAT_ADD(batch_evictions, count - 1);
+}
+
+/**
+ * Bring page from the compressed pool or disk back into heap.
+ *
+ * @param shard the shard that owns the allocation.
+ * @param page the page to bring into memory.
+ * @param page_idx the index of where in memory the page should be placed.
+ */
+void pm_load_from_disk(pm_shard_t* shard, page_t* page, int page_idx) {
+    unsigned long start = pm_now_ns();
+    int flags = 0;
+    PM_STAT_ADD(faults, 1);
+    pm_seq_begin(page_idx);
+
+    // update page_idx (now in memory) and hand it to the policy.
+    __atomic_store_n(&page->page_idx, page_idx, __ATOMIC_RELAXED);
+    dirty_blocks[page_idx] = 0;
+    policy->insert(shard, page);
+
+    // a page in the compressed pool is newer than any copy on disk, so it stays dirty once loaded.
+    if (zpool_bytes && zentries[page->alloc_idx].chunk >= 0) {
+        if (!pm_zpool_read(shard, page->alloc_idx, &pm_heap[page_idx * page_size])) {
+            memset(&pm_heap[page_idx * page_size], '\0', page_size);
+            printf("Error pm_load_from_disk(): unable to decompress contents into memory for alloc %d\n", page->alloc_idx);
+        }
+        pm_zpool_remove(shard, page->alloc_idx);
+        pm_mark_dirty(page, 0, page_size);
+        PM_STAT_ADD(pool_hits, 1);
+        flags = PM_TRACE_POOL;
+    } else if (page->swap_slot < 0) {
+        // an allocation that was never written to disk has no slot, so its contents are '\0'.
+        memset(&pm_heap[page_idx * page_size], '\0', page_size);
+    } else if (!pm_swap_io(false, &pm_heap[page_idx * page_size], page->swap_slot)) {
+        // reset page contents to '\0' by default.
+        memset(&pm_heap[page_idx * page_size], '\0', page_size);
+        printf("Error pm_load_from_disk(): unable to read contents from disk into memory for alloc %d\n", page->alloc_idx);
+    }
+
+    pm_seq_end(page_idx);
+    pm_trace(PM_TRACE_FAULT, page->alloc_idx, page_idx, flags, start);
+}
+
+/**
+ * Borrow a page in memory from another shard by evicting that shard's victim. A shard that has lent out
+ * every page it owns and whose allocations are all on disk has nothing of its own to evict, so this is
+ * the only way it can bring them back while the other shards are full. Like pm_steal_page, other shards
+ * are only tried, never waited on.
+ *
+ * @param shard the shard that is out of pages.
+ * @return the page index of the borrowed page or -1 if no other shard had a page to spare.
+ */
+int pm_steal_victim(pm_shard_t* shard) {
+    for (unsigned int i = 1; i < shard_count; i++) {
+        pm_shard_t* victim = &shards[(shard - shards + i) % shard_count];
+        if (pthread_mutex_trylock(&victim->lock) != 0) {
+            continue;
+        }
+
+        // the victim keeps at least one page in memory, so it can always bring its own allocations back.
+        int page_idx = -1;
+        page_t* page_to_evict = pm_resident_count(victim) > 1 ? policy->victim(victim, NULL) : NULL;
+        if (page_to_evict) {
+            page_idx = page_to_evict->page_idx;
+            pm_page_out(victim, page_to_evict);
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (page_idx >= 0) {
+            return page_idx;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Find open page in memory and mark it as used. If the shard has none, borrow one from another shard
+ * (if stealing is enabled) or else evict the page chosen by the replacement policy.
+ *
+ * @param shard the shard that needs a page.
+ * @param incoming the allocation the page is for.
+ * @return the page index for a page in memory or -1 if every page in the shard's memory is pinned.
+ */
+int pm_claim_page(pm_shard_t* shard, page_t* incoming) {
+    if (policy->fault && incoming) {
+        policy->fault(shard, incoming);
+    }
+
+    // check if open page in memory.
+    int open_page_idx = pm_find_page(shard);
+    if (open_page_idx >= 0) {
+        pm_bitmap_set(&shard->avail_pages, open_page_idx - shard->page_base);
+        return open_page_idx;
+    }
+
+    // check if another shard has an open page to lend.
+    if (steal_pages) {
+        open_page_idx = pm_steal_page(shard);
+        if (open_page_idx >= 0) {
+            return open_page_idx;
+        }
+    }
+
+    // if no open page, evict a page currently in memory, with the next victims if evicting in batches. Its
+    // page stays marked as used.
+    page_t* page_to_evict = policy->victim(shard, incoming);
+    if (!page_to_evict) {
+        return steal_pages ? pm_steal_victim(shard) : -1;
+    }
+    open_page_idx = page_to_evict->page_idx;
+    if (evict_batch > 1) {
+        pm_page_out_batch(shard, incoming, page_to_evict);
+    } else {
+        pm_page_out(shard, page_to_evict);
+    }
+
+    return open_page_idx;
+}
+
+/**
+ * If page is not current in memory, bring into memory by finding open page or evicting a page in memory.
+ * 
+ * @param shard the shard that owns the allocation.
+ * @param page the page to potentially bring into memory from disk.
+ * @return true if the page is in memory, false if there was no room because every page in memory is pinned.
+*/
+bool pm_load_alloc(pm_shard_t* shard, page_t* page) {
+    if (page->page_idx < 0) {
+        int open_page_idx = pm_claim_page(shard, page);
+        if (open_page_idx < 0) {
+            return false;
+        }
+
+        // load contents back into memory
+        pm_load_from_disk(shard, page, open_page_idx);
+    }
+
+    return true;
+}
+
+/**
+ * Claim a page in memory of a shard for an allocation read ahead: an open page, or else the page of the
+ * policy's victim if it is clean, so reading ahead never writes anything back or borrows from other shards.
+ *
+ * @param shard the shard that needs a page.
+ * @param keep an allocation that must stay in memory, or NULL.
+ * @return the page index or -1 if the shard has no open page and its victim is dirty, keep or a page
+ *     read ahead that hasn't been accessed yet.
+ */
+int pm_readahead_frame(pm_shard_t* shard, page_t* keep) {
+    int page_idx = pm_find_page(shard);
+    if (page_idx >= 0) {
+        pm_bitmap_set(&shard->avail_pages, page_idx - shard->page_base);
+        return page_idx;
+    }
+
+    page_t* victim = policy->victim(shard, NULL);
+    if (!victim || victim == keep || victim->dirty || victim->prefetched) {
+        return -1;
+    }
+    page_idx = victim->page_idx;
+    pm_page_out(shard, victim);
+    return page_idx;
+}
+
+/**
+ * Bring allocations of a shard that are on disk or in the compressed pool into memory ahead of their
+ * accesses, in order until pm_readahead_frame has no page left for one. Those on disk are read in order
+ * of swap slot, with a single preadv for every run of consecutive slots. The shard's lock must be held.
+ *
+ * @param shard the shard that owns the allocations.
+ * @param pages the allocations. None may be in memory or hold only '\0' (see pm_zero_alloc).
+ * @param count the number of allocations. At most READAHEAD_MAX.
+ * @param keep an allocation that must stay in memory, or NULL.
+ * @return the number of allocations brought into memory, which are the first ones of pages.
+ */
+int pm_prefetch_pages(pm_shard_t* shard, page_t** pages, int count, page_t* keep) {
+    unsigned long start = pm_now_ns();
+    page_t* reads[READAHEAD_MAX];
+    int read_count = 0;
+    int loaded = 0;
+
+    // a page's sequence stays odd until its contents are read, so nothing reads it without the lock meanwhile.
+    for (; loaded < count; loaded++) {
+        page_t* page = pages[loaded];
+        int page_idx = pm_readahead_frame(shard, keep);
+        if (page_idx < 0) {
+            break;
+        }
+        pm_seq_begin(page_idx);
+        __atomic_store_n(&page->page_idx, page_idx, __ATOMIC_RELAXED);
+        __atomic_store_n(&page->prefetched, true, __ATOMIC_RELAXED);
+        dirty_blocks[page_idx] = 0;
+        policy->insert(shard, page);
+
+        // like a fault, a page in the compressed pool is newer than any copy on disk.
+        if (zpool_bytes && zentries[page->alloc_idx].chunk >= 0) {
+            if (!pm_zpool_read(shard, page->alloc_idx, &pm_heap[page_idx * page_size])) {
+                memset(&pm_heap[page_idx * page_size], '\0', page_size);
+                printf("Error pm_prefetch(): unable to decompress contents into memory for alloc %d\n", page->alloc_idx);
+            }
+            pm_zpool_remove(shard, page->alloc_idx);
+            pm_mark_dirty(page, 0, page_size);
+        } else {
+            reads[read_count++] = page;
+        }
+    }
+
+    qsort(reads, read_count, sizeof(page_t*), pm_cmp_slot);
+    for (int first = 0; first < read_count; ) {
+        int run = 1;
+        while (first + run < read_count && reads[first + run]->swap_slot == reads[first]->swap_slot + run) {
+            run++;
+        }
+        if (!pm_swap_readv(&reads[first], run)) {
+            printf("Error pm_prefetch(): unable to read contents from disk into memory for allocs %d to %d\n",
+                reads[first]->alloc_idx, reads[first + run - 1]->alloc_idx);
+        }
+        first += run;
+    }
+
+    for (int i = 0; i < loaded; i++) {
+        pm_seq_end(pages[i]->page_idx);
+        pm_trace(PM_TRACE_FAULT, pages[i]->alloc_idx, pages[i]->page_idx, PM_TRACE_READAHEAD, start);
+    }
+    PM_STAT_ADD(readahead_pages, loaded);
+    return loaded;
+}
+
+/**
+ * Follow the stride between the allocations a thread faults in or first accesses after they were read
+ * ahead. Once READAHEAD_STREAK (two) strides in a row are the same, which is at the third access along the
+ * stride, keep readahead_pages allocations along it read ahead of the access, topping the window up once no
+ * more than half of it is left, so pages on disk are read in batches. The shard's lock must be held.
+ *
+ * @param shard the shard that owns the allocation.
+ * @param page the allocation accessed, which is in memory.
+ */
+void pm_readahead(pm_shard_t* shard, page_t* page) {
+    pm_readahead_t* ra = &thread_readahead;
+    if (ra->generation != heap_generation) {
+        *ra = (pm_readahead_t) { heap_generation, -1, 0, 0, -1 };
+    }
+
+    long alloc_idx = page->alloc_idx;
+    long stride = ra->last >= 0 ? alloc_idx - ra->last : 0;
+    if (stride != 0 && stride == ra->stride) {
+        ra->streak++;
+    } else {
+        ra->stride = stride;
+        ra->streak = stride != 0;
+        ra->next = alloc_idx + stride;
+    }
+    ra->last = alloc_idx;
+    if (ra->streak < READAHEAD_STREAK || labs(stride) > READAHEAD_STRIDE) {
+        return;
+    }
+
+    // allocations before next along the stride were read ahead already.
+    if ((ra->next - alloc_idx) / stride < 1) {
+        ra->next = alloc_idx + stride;
+    }
+    if ((ra->next - alloc_idx) / stride - 1 > (long) readahead_pages / 2) {
+        return;
+    }
+
+    // the window stops at the end of the shard's allocations.
+    page_t* pages[READAHEAD_MAX];
+    int count = 0;
+    long end = alloc_idx + (long) readahead_pages * stride;
+    long a = ra->next;
+    for (; stride > 0 ? a <= end : a >= end; a += stride) {
+        if (a < (long) shard->alloc_base || a >= (long) (shard->alloc_base + shard->alloc_count)) {
+            break;
+        }
+        page_t* target = &alloc_region[a];
+        if (pm_bitmap_test(&shard->avail_allocs, a - shard->alloc_base) && !__atomic_load_n(&target->cached, __ATOMIC_RELAXED)
+                && target->page_idx < 0 && !pm_zero_alloc(target)) {
+            pages[count++] = target;
+        }
+    }
+
+    // an allocation that found no page is tried again by the next access.
+    int loaded = pm_prefetch_pages(shard, pages, count, page);
+    ra->next = loaded < count ? (long) pages[loaded]->alloc_idx : a;
+}
+
+/**
+ * Write back dirty pages among the coldest flush watermark pages of each list in memory of a shard.
+ * Each page is copied under the shard's lock and written without it, and only marked clean if it
+ * wasn't changed meanwhile.
+ *
+ * @param shard the shard to clean.
+ * @param buf a page_size buffer to copy pages into.
+ */
+void pm_flush_shard(pm_shard_t* shard, char* buf) {
+    pm_shard_lock(shard);
+
+    for (int l = 0; l < policy->resident_lists; l++) {
+        unsigned long seen = 0;
+        int alloc_idx = shard->lists[l].tail;
+        while (alloc_idx >= 0 && seen < shard->flush_watermark) {
+            page_t* page = &alloc_region[alloc_idx];
+            seen++;
+
+            // a page being written back can't be evicted, so leave the shard's last evictable page to
+            // eviction. Otherwise a shard that lent its other pages has no victim until the write is done.
+            if (!page->dirty || pm_resident_count(shard) < 2) {
+                alloc_idx = page->lru_prev;
+                continue;
+            }
+
+            // copy the page, and remember its sequence to tell if it changes during the write.
+            int page_idx = page->page_idx;
+            int slot = pm_swap_slot(shard, page);
+            if (slot < 0) {
+                alloc_idx = page->lru_prev;
+                continue;
+            }
+            unsigned int seq = page_seqs[page_idx];
+            uint64_t blocks = dirty_blocks[page_idx];
+            memcpy(buf, &pm_heap[page_idx * page_size], page_size);
+            shard->flush_alloc = alloc_idx;
+            shard->flush_slot = slot;
+            shard->flush_slot_freed = false;
+            shard->flush_written = false;
+
+            // remove any saved metadata before the write, while the shard's lock is still held, so the
+            // page isn't held back from eviction for longer.
+            if (__atomic_load_n(&meta_saved, __ATOMIC_ACQUIRE)) {
+                pm_meta_invalidate();
+            }
+
+            pthread_mutex_unlock(&shard->lock);
+            bool written = pm_swap_write_blocks(buf, slot, blocks);
+            uint64_t hash = dedup && written ? pm_page_hash(buf) : 0;
+            pthread_mutex_lock(&flusher_lock);
+            shard->flush_written = true;
+            pthread_cond_broadcast(&flush_write_cond);
+            pthread_mutex_unlock(&flusher_lock);
+            pm_shard_lock(shard);
+
+            shard->flush_alloc = -1;
+            pthread_cond_broadcast(&shard->flush_done);
+            if (shard->flush_slot_freed) {
+                // freed during the write, and its slot could only be released now unless it was taken over.
+                if (shard->flush_slot >= 0) {
+                    pm_bitmap_clear(&shard->avail_slots, slot - shard->alloc_base);
+                }
+                alloc_idx = shard->lists[l].tail;
+                continue;
+            }
+            if (!written) {
+                printf("Error pm_flush_shard(): unable to write contents to disk for page %d\n", alloc_idx);
+            } else {
+                PM_STAT_ADD(flusher_writes, 1);
+                if (page->page_idx == page_idx && page_seqs[page_idx] == seq) {
+                    page->dirty = false;
+                    dirty_blocks[page_idx] = 0;
+                }
+                // the slot holds the copy written, whether or not the page changed since.
+                if (dedup) {
+                    pm_dedup_add(shard, slot, hash);
+                }
+            }
+
+            // carry on towards the head, unless the page was pinned or moved to another list meanwhile.
+            alloc_idx = page->lru_list == l ? page->lru_prev : shard->lists[l].tail;
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Flusher thread: cleans every shard, then sleeps until the next interval or until it is kicked.
+ *
+ * @param data unused.
+ * @return NULL always.
+ */
+void* pm_flusher(void* data) {
+    (void) data;
+    char* buf = malloc(page_size);
+
+    pthread_mutex_lock(&flusher_lock);
+    while (!flusher_stop) {
+        flusher_kicked = false;
+        pthread_mutex_unlock(&flusher_lock);
+
+        for (unsigned int s = 0; s < shard_count; s++) {
+            pm_flush_shard(&shards[s], buf);
+        }
+
+        pthread_mutex_lock(&flusher_lock);
+        if (!flusher_stop && !flusher_kicked) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&flusher_cond, &flusher_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&flusher_lock);
+
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Async worker thread: faults in the page of each queued pm_access_async call and invokes its callback.
+ * Once stopped, it finishes the calls still queued before returning.
+ *
+ * @param data unused.
+ * @return NULL always.
+ */
+void* pm_async_worker(void* data) {
+    (void) data;
+
+    pthread_mutex_lock(&async_lock);
+    while (true) {
+        while (!async_head && !async_stop) {
+            pthread_cond_wait(&async_cond, &async_lock);
+        }
+        pm_async_req_t* req = async_head;
+        if (!req) {
+            break;
+        }
+        async_head = req->next;
+        if (!async_head) {
+            async_tail = NULL;
+        }
+        pthread_mutex_unlock(&async_lock);
+
+        // blocks this worker only, other workers keep faulting in pages of other shards.
+        bool read = pm_read(req->ptr, req->off, req->data, req->len, NULL);
+        req->cb(req->ptr, read ? req->data : NULL, req->len, req->ctx);
+        free(req);
+
+        pthread_mutex_lock(&async_lock);
+    }
+    pthread_mutex_unlock(&async_lock);
+
+    return NULL;
+}
+
+/**
+ * Print internal state of the heap.
+ *
+ * @param debug_info the debug info to print with.
+ * @param ptr the pointer to print with.
+ */
+void pm_print_debug(debug_t* debug_info, void* ptr) {
+    if (debug_info) {
+        printf("%s (%p)\n", debug_info->completionMsg, ptr);
+        pm_print_heap();
+        pm_print_allocations();
+    }
+}
+
+/**
+ * Determine if the given ptr points at a page_t structure in the allocation region.
+ *
+ * @param ptr the pointer to evaluate.
+ * @return the index of the allocation, or -1 if ptr doesn't point at one.
+ */
+long pm_alloc_index(page_t* ptr) {
+    // compare as integers so pointers outside the arena are never dereferenced.
+    unsigned long alloc_byte = (unsigned long) ptr - (unsigned long) alloc_region;
+
+    if (!ptr || !pm_heap
+            || (unsigned long) ptr < (unsigned long) alloc_region
+            || alloc_byte >= total_allocs * sizeof(page_t)
+            || alloc_byte % sizeof(page_t) != 0) {
+        return -1;
+    }
+
+    return alloc_byte / sizeof(page_t);
+}
+
+/**
+ * Determine if the given ptr is a valid page_t structure, and lock the shard that owns it.
+ * 
+ * @param ptr the pointer to evaluate.
+ * @param caller the name of the calling function, for error messages.
+ * @return the shard with its lock held, or NULL (and nothing locked) if ptr is invalid.
+*/
+pm_shard_t* pm_lock_alloc(page_t* ptr, const char* caller) {
+    long alloc_idx = pm_alloc_index(ptr);
+    if (alloc_idx < 0) {
+        printf("Error %s(): page_t* arg does not point to a valid address.\n", caller);
+        return NULL;
+    }
+
+    // whether the allocation is in use can only be checked under the lock of its shard.
+    pm_shard_t* shard = pm_alloc_shard(alloc_idx);
+    pm_shard_lock(shard);
+
+    if (!pm_bitmap_test(&shard->avail_allocs, alloc_idx - shard->alloc_base)
+            || __atomic_load_n(&ptr->cached, __ATOMIC_ACQUIRE)) {
+        printf("Error %s(): page_t* arg does not point to a valid address.\n", caller);
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+
+    return shard;
+}
+
+/**
+ * Determine if a byte range doesn't fit within a page.
+ *
+ * @param off the offset of the first byte.
+ * @param len the number of bytes.
+ * @return true if the range is invalid, false otherwise.
+ */
+bool pm_invalid_range(unsigned long off, unsigned long len) {
+    return len > page_size || off > page_size - len;
+}
+
+/**
+ * Validate ptr, request the lock of its shard and bring the allocation into memory as the most recently used page.
+ * A read of an allocation that holds only '\0' and isn't in memory is served from zero_page instead.
+ *
+ * @param ptr the pointer to access.
+ * @param caller the name of the calling function, for error messages.
+ * @param read_only true if the caller only reads the bytes returned.
+ * @param shard_out where to store the shard whose lock is held.
+ * @return the page's bytes in memory with the lock held, or NULL with the lock released if ptr is invalid
+ *     or the page couldn't be brought into memory.
+ */
+char* pm_lock_page(page_t* ptr, const char* caller, bool read_only, pm_shard_t** shard_out) {
+    pm_shard_t* shard = pm_lock_alloc(ptr, caller);
+    if (!shard) {
+        return NULL;
+    }
+
+    // an allocation that was never written keeps no page in memory until it is.
+    PM_STAT_ADD(accesses, 1);
+    if (read_only && pm_zero_alloc(ptr)) {
+        PM_STAT_ADD(zero_reads, 1);
+        *shard_out = shard;
+        return zero_page;
+    }
+
+    // load allocation into memory if not already present in memory.
+    bool hit = ptr->page_idx >= 0;
+    if (hit) {
+        PM_STAT_ADD(hits, 1);
+    }
+    if (!pm_load_alloc(shard, ptr)) {
+        printf("Error %s(): every page in memory is pinned.\n", caller);
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+
+    // let the replacement policy record a hit. A fault was just inserted, and the first write of a new
+    // allocation is a fault too, so counting it again would make every new page look used twice.
+    if (hit && ptr->pin_count == 0) {
+        policy->access(shard, ptr);
+    }
+
+    // a fault, or the first access to a page read ahead, moves the thread's readahead along.
+    bool prefetched = ptr->prefetched;
+    if (prefetched) {
+        __atomic_store_n(&ptr->prefetched, false, __ATOMIC_RELAXED);
+        PM_STAT_ADD(readahead_hits, 1);
+    }
+    if (readahead_pages > 0 && (!hit || prefetched)) {
+        pm_readahead(shard, ptr);
+    }
+
+    *shard_out = shard;
+    return &pm_heap[ptr->page_idx * page_size];
+}
+
+/**
+ * Try to copy bytes out of a page in memory without taking any lock. The copy is retried under the
+ * lock by the caller if the page isn't in memory or is changed while it is being copied.
+ *
+ * @param ptr the pointer to read from.
+ * @param off the position of the first byte to read.
+ * @param dst where to copy the bytes to.
+ * @param len the number of bytes to read. Must fit within a page.
+ * @return true if the bytes were copied from a consistent page, false if the caller must take the lock.
+ */
+bool pm_read_optimistic(page_t* ptr, unsigned long off, void* dst, unsigned long len) {
+    long alloc_idx = pm_alloc_index(ptr);
+    if (alloc_idx < 0) {
+        return false;
+    }
+
+    // the allocation must be in use and in memory.
+    pm_shard_t* shard = pm_alloc_shard(alloc_idx);
+    unsigned long bit = alloc_idx - shard->alloc_base;
+    if (!((__atomic_load_n(&shard->avail_allocs.words[bit / 64], __ATOMIC_RELAXED) >> (bit % 64)) & 1)) {
+        return false;
+    }
+    int page_idx = __atomic_load_n(&ptr->page_idx, __ATOMIC_RELAXED);
+    if (page_idx < 0) {
+        return false;
+    }
+
+    // the page must not be changing, and must still hold this allocation once the sequence is read. The
+    // first access to a page read ahead takes the lock, to move readahead along.
+    unsigned int seq = __atomic_load_n(&page_seqs[page_idx], __ATOMIC_ACQUIRE);
+    if (seq % 2 != 0 || __atomic_load_n(&ptr->page_idx, __ATOMIC_RELAXED) != page_idx
+            || __atomic_load_n(&ptr->cached, __ATOMIC_RELAXED) || __atomic_load_n(&ptr->prefetched, __ATOMIC_RELAXED)) {
+        return false;
+    }
+
+    memcpy(dst, &pm_heap[page_idx * page_size + off], len);
+
+    // if the sequence moved, the copy may be torn.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&page_seqs[page_idx], __ATOMIC_RELAXED) != seq) {
+        return false;
+    }
+
+    // the policy's lists can't be updated without the lock, so mark the page for a second chance instead.
+    if (!__atomic_load_n(&ptr->referenced, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&ptr->referenced, true, __ATOMIC_RELAXED);
+    }
+
+    PM_STAT_ADD(accesses, 1);
+    PM_STAT_ADD(hits, 1);
+    return true;
+}
+
+/**
+ * Release what an allocation holds: its swap slot, its place in the policy's lists, its compressed copy
+ * and its page in memory. The allocation itself stays marked as used. The shard's lock must be held.
+ *
+ * @param shard the shard that owns the allocation.
+ * @param ptr the allocation.
+ * @return a page borrowed from another shard, to give back with pm_return_page once the lock is released,
+ *     or -1.
+ */
+int pm_release_alloc(pm_shard_t* shard, page_t* ptr) {
+    pm_release_slot(shard, ptr);
+
+    // the policy forgets the allocation, whether it is in memory or remembered as evicted recently.
+    pm_list_remove(shard, ptr);
+
+    // drop its compressed copy, if any.
+    if (zpool_bytes && zentries[ptr->alloc_idx].chunk >= 0) {
+        pm_zpool_remove(shard, ptr->alloc_idx);
+    }
+
+    // reset any calls to pm_put and mark page in memory as available.
+    int page_idx = ptr->page_idx;
+    int borrowed_page_idx = -1;
+    if (page_idx >= 0) {
+        pm_seq_begin(page_idx);
+        memset(&pm_heap[page_idx * page_size], '\0', page_size);
+        __atomic_store_n(&ptr->page_idx, -1, __ATOMIC_RELAXED);
+        pm_seq_end(page_idx);
+        if (!pm_release_page(shard, page_idx)) {
+            borrowed_page_idx = page_idx;
+        }
+    }
+
+    return borrowed_page_idx;
+}
+
+/**
+ * Shard that the calling thread allocates from first.
+ *
+ * @return the index of the shard.
+ */
+unsigned int pm_home_shard() {
+    if (!thread_seq_set) {
+        thread_seq = __atomic_fetch_add(&thread_count, 1, __ATOMIC_RELAXED);
+        thread_seq_set = true;
+    }
+
+    return thread_seq % shard_count;
+}
+
+/**
+ * Reset an allocation that stays marked as used in its shard while it is held in a thread's cache.
+ *
+ * @param alloc_idx the allocation, which must not be in memory.
+ */
+void pm_cache_reset(int alloc_idx) {
+    alloc_region[alloc_idx] = (page_t) { alloc_idx, -1, false, -1, -1, -1, -1, 0, false, true, false };
+}
+
+/**
+ * Settle this thread's cache with its home shard, under the shard's lock. The frees waiting in the cache
+ * are finished, keeping the allocations reserved while there is room. Then the cache is refilled with a
+ * batch of allocations, or gives back every allocation it reserved.
+ *
+ * @param cache this thread's cache.
+ * @param refill true to reserve allocations up to a batch.
+ * @param release true to give back every reserved allocation.
+ */
+void pm_cache_sync(pm_thread_cache_t* cache, bool refill, bool release) {
+    pm_shard_t* shard = &shards[pm_home_shard()];
+    pm_shard_lock(shard);
+
+    // finishing a free leaves the page borrowed from another shard in freed, if any.
+    for (unsigned int i = 0; i < cache->freed_count; i++) {
+        int alloc_idx = cache->freed[i];
+        cache->freed[i] = pm_release_alloc(shard, &alloc_region[alloc_idx]);
+        pm_cache_reset(alloc_idx);
+        if (!release && cache->reserved_count < 2 * thread_cache_size) {
+            cache->reserved[cache->reserved_count++] = alloc_idx;
+        } else {
+            pm_bitmap_clear(&shard->avail_allocs, alloc_idx - shard->alloc_base);
+            alloc_region[alloc_idx].cached = false;
+        }
+    }
+
+    while (release && cache->reserved_count > 0) {
+        int alloc_idx = cache->reserved[--cache->reserved_count];
+        pm_bitmap_clear(&shard->avail_allocs, alloc_idx - shard->alloc_base);
+        alloc_region[alloc_idx].cached = false;
+    }
+
+    while (refill && cache->reserved_count < thread_cache_size) {
+        int alloc_idx = pm_find_alloc(shard);
+        if (alloc_idx < 0) {
+            break;
+        }
+        pm_bitmap_set(&shard->avail_allocs, alloc_idx - shard->alloc_base);
+        pm_cache_reset(alloc_idx);
+        cache->reserved[cache->reserved_count++] = alloc_idx;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    for (unsigned int i = 0; i < cache->freed_count; i++) {
+        if (cache->freed[i] >= 0) {
+            pm_return_page(cache->freed[i]);
+        }
+    }
+    cache->freed_count = 0;
+}
+
+/**
+ * Give back everything in an exiting thread's cache.
+ *
+ * @param data the thread's pm_thread_cache_t.
+ */
+void pm_cache_exit(void* data) {
+    pm_thread_cache_t* cache = (pm_thread_cache_t*) data;
+    if (pm_heap && cache->generation == heap_generation) {
+        pm_cache_sync(cache, false, true);
+    }
+
+    thread_cache = NULL;
+    free(cache->reserved);
+    free(cache->freed);
+    free(cache);
+}
+
+/**
+ * Create the key whose destructor empties a thread's cache.
+ */
+void pm_cache_key_create() {
+    pthread_key_create(&cache_key, pm_cache_exit);
+}
+
+/**
+ * This thread's cache for the current heap, created on first use.
+ *
+ * @return the cache, or NULL if it couldn't be allocated.
+ */
+pm_thread_cache_t* pm_thread_cache() {
+    pm_thread_cache_t* cache = thread_cache;
+    if (cache && cache->generation == heap_generation) {
+        return cache;
+    }
+
+    if (!cache) {
+        pthread_once(&cache_once, pm_cache_key_create);
+        cache = calloc(1, sizeof(pm_thread_cache_t));
+        if (!cache) {
+            return NULL;
+        }
+        pthread_setspecific(cache_key, cache);
+        thread_cache = cache;
+    }
+
+    // a cache filled for an earlier heap holds nothing of this one, and may be sized differently.
+    free(cache->reserved);
+    free(cache->freed);
+    cache->reserved = malloc(2 * thread_cache_size * sizeof(int));
+    cache->freed = malloc(thread_cache_size * sizeof(int));
+    cache->reserved_count = 0;
+    cache->freed_count = 0;
+    cache->generation = cache->reserved && cache->freed ? heap_generation : 0;
+    return cache->generation ? cache : NULL;
+}
+
+/**
+ * Free an allocation of this thread's home shard without its lock, by adding it to the thread's cache.
+ * The free is finished with the rest of its batch.
+ *
+ * @param ptr the pointer to free.
+ * @param debug_info the debug info to print with a successful free, or NULL.
+ * @return true if the free was handled, false if it must take the shard's lock.
+ */
+bool pm_cache_free(page_t* ptr, debug_t* debug_info) {
+    pm_thread_cache_t* cache = pm_thread_cache();
+    long alloc_idx = pm_alloc_index(ptr);
+    if (!cache || alloc_idx < 0) {
+        return false;
+    }
+
+    // pinned allocations and those of other shards, or not in use, are left to the locked path.
+    pm_shard_t* shard = pm_alloc_shard(alloc_idx);
+    unsigned long bit = alloc_idx - shard->alloc_base;
+    if (shard != &shards[pm_home_shard()] || __atomic_load_n(&ptr->pin_count, __ATOMIC_RELAXED) > 0
+            || !((__atomic_load_n(&shard->avail_allocs.words[bit / 64], __ATOMIC_RELAXED) >> (bit % 64)) & 1)) {
+        return false;
+    }
+
+    // an allocation in a cache is not in use, e.g. it was freed already.
+    if (__atomic_exchange_n(&ptr->cached, true, __ATOMIC_ACQ_REL)) {
+        printf("Error pm_free(): page_t* arg does not point to a valid address.\n");
+        return true;
+    }
+
+    pm_print_debug(debug_info, ptr);
+    cache->freed[cache->freed_count++] = alloc_idx;
+    if (cache->freed_count == thread_cache_size) {
+        pm_cache_sync(cache, false, false);
+    }
+    return true;
+}
+
+//------------ Functions declared in pm_heap.h ---------------------//
+
+/**
+ * Take a free slot of a size class for a new object, allocating a page for the class if none has one.
+ * Called with the class's lock held.
+ *
+ * @param cls the size class.
+ * @param size_class the index of the class.
+ * @return the handle of the object, or 0 if no page could be allocated.
+ */
+pm_obj_t pm_slab_take(pm_slab_class_t* cls, unsigned int size_class) {
+    pm_slab_t* slab = cls->partial;
+    if (!slab) {
+        slab = calloc(1, sizeof(pm_slab_t) + BITMAP_WORDS(cls->slots) * sizeof(uint64_t));
+        if (!slab) {
+            printf("Error pm_obj_malloc(): out of memory.\n");
+            return 0;
+        }
+        slab->page = pm_malloc(page_size, NULL);
+        if (!slab->page) {
+            printf("Error pm_obj_malloc(): couldn't allocate a page for %lu B objects.\n", cls->size);
+            free(slab);
+            return 0;
+        }
+        slab->size_class = size_class;
+        slab->cls = cls;
+        cls->partial = slab;
+        __atomic_store_n(&obj_slabs[slab->page->alloc_idx], slab, __ATOMIC_RELEASE);
+    }
+
+    // the lowest clear bit is a slot, since the bits past the last slot are never set.
+    while (slab->used_map[slab->hint] == ~0ULL) {
+        slab->hint++;
+    }
+    unsigned int slot = slab->hint * 64 + __builtin_ctzll(~slab->used_map[slab->hint]);
+
+    // a slot that held an object before is cleared, which brings the page into memory.
+    if (slot < slab->fresh && !pm_write(slab->page, slot * cls->size, zero_page, cls->size, NULL)) {
+        printf("Error pm_obj_malloc(): couldn't clear a slot for a %lu B object.\n", cls->size);
+        return 0;
+    }
+    if (slot >= slab->fresh) {
+        slab->fresh = slot + 1;
+    }
+    slab->used_map[slab->hint] |= 1ULL << (slot % 64);
+
+    // a full page leaves the class's list until an object of it is freed.
+    if (++slab->used == cls->slots) {
+        cls->partial = slab->next;
+        if (slab->next) {
+            slab->next->prev = NULL;
+        }
+        slab->next = NULL;
+    }
+    return OBJ_HANDLE(slab->page->alloc_idx, size_class, slot);
+}
+
+/**
+ * Allocate an object of whole pages, with pm_malloc_batch.
+ *
+ * @param bytes the size of the object, more than a size class holds.
+ * @return the handle of the object, or 0 if there aren't enough allocations.
+ */
+pm_obj_t pm_span_malloc(unsigned long bytes) {
+    unsigned long count = bytes / page_size + (bytes % page_size != 0);
+    if (count > total_allocs) {
+        printf("Error pm_obj_malloc(): requested object size is invalid (%lu).\n", bytes);
+        return 0;
+    }
+
+    // sizes is filled below, but at -O2 gcc can't tell, and warns that pm_malloc_batch's const argument may be
+    // uninitialized unless it comes from calloc.
+    pm_span_t* span = malloc(sizeof(pm_span_t) + count * sizeof(page_t*));
+    unsigned long* sizes = calloc(count, sizeof(unsigned long));
+    if (!span || !sizes) {
+        printf("Error pm_obj_malloc(): out of memory.\n");
+        free(span);
+        free(sizes);
+        return 0;
+    }
+    for (unsigned long i = 0; i < count; i++) {
+        sizes[i] = page_size;
+    }
+
+    // the pages are taken together, so an object larger than memory starts out partly on disk.
+    unsigned long made = pm_malloc_batch(count, sizes, span->pages);
+    free(sizes);
+    if (made < count) {
+        printf("Error pm_obj_malloc(): not enough allocations for %lu pages.\n", count);
+        pm_free_batch(made, span->pages);
+        free(span);
+        return 0;
+    }
+
+    span->bytes = bytes;
+    span->count = count;
+    int alloc_idx = span->pages[0]->alloc_idx;
+    __atomic_store_n(&obj_spans[alloc_idx], span, __ATOMIC_RELEASE);
+    return OBJ_HANDLE(alloc_idx, OBJ_SPAN, 0);
+}
+
+/**
+ * Copy a range of bytes out of or into an object, on each page the range covers.
+ *
+ * @param obj the object.
+ * @param off the position of the first byte.
+ * @param buf where to copy the bytes to or from.
+ * @param len the number of bytes.
+ * @param write true to copy buf into the object, false to copy the object into buf.
+ * @param fn the name of the calling function, for errors.
+ * @return true if the bytes were copied, false if obj isn't allocated or the range is invalid.
+ */
+bool pm_obj_copy(pm_obj_t obj, unsigned long off, char* buf, unsigned long len, bool write, const char* fn) {
+    long alloc_idx = OBJ_ALLOC(obj);
+    unsigned int size_class = OBJ_CLASS(obj);
+    unsigned int slot = OBJ_SLOT(obj);
+    if (!pm_heap || alloc_idx < 0 || (unsigned long) alloc_idx >= total_allocs) {
+        printf("Error %s(): object is invalid.\n", fn);
+        return false;
+    }
+
+    // the object can't be freed until the copy is done.
+    pm_shard_t* shard = pm_alloc_shard(alloc_idx);
+    pthread_rwlock_rdlock(&shard->obj_lock);
+    pm_slab_t* slab = NULL;
+    pm_span_t* span = NULL;
+    if (size_class != OBJ_SPAN) {
+        slab = __atomic_load_n(&obj_slabs[alloc_idx], __ATOMIC_ACQUIRE);
+    } else if (slot == 0) {
+        span = __atomic_load_n(&obj_spans[alloc_idx], __ATOMIC_ACQUIRE);
+    }
+    if (slab ? slab->size_class != size_class || slot >= slab->cls->slots : !span) {
+        printf("Error %s(): object is invalid.\n", fn);
+        pthread_rwlock_unlock(&shard->obj_lock);
+        return false;
+    }
+    if (slab) {
+        pthread_mutex_lock(&slab->cls->lock);
+        bool used = slab->used_map[slot / 64] & (1ULL << (slot % 64));
+        pthread_mutex_unlock(&slab->cls->lock);
+        if (!used) {
+            printf("Error %s(): object is not allocated.\n", fn);
+            pthread_rwlock_unlock(&shard->obj_lock);
+            return false;
+        }
+    }
+
+    // an object of a size class is a range of its page, and an object of whole pages a range of them all.
+    unsigned long bytes = slab ? slab->cls->size : span->bytes;
+    if (len > bytes || off > bytes - len) {
+        printf("Error %s(): range is invalid (off=%lu, len=%lu).\n", fn, off, len);
+        pthread_rwlock_unlock(&shard->obj_lock);
+        return false;
+    }
+    page_t** pages = slab ? &slab->page : span->pages;
+    off += slab ? slot * bytes : 0;
+
+    // copy the part of the range on each page in turn.
+    bool copied = true;
+    while (copied && len > 0) {
+        page_t* page = pages[off / page_size];
+        unsigned long page_off = off % page_size;
+        unsigned long n = page_size - page_off < len ? page_size - page_off : len;
+        copied = write ? pm_write(page, page_off, buf, n, NULL) : pm_read(page, page_off, buf, n, NULL);
+        off += n;
+        buf += n;
+        len -= n;
+    }
+    pthread_rwlock_unlock(&shard->obj_lock);
+    return copied;
+}
+
+page_t* pm_malloc(unsigned long bytes, debug_t* debug_info) {
+    // Validate the size of the request.
+    if (bytes > page_size) {
+        printf("Error pm_malloc(): requested allocation size is invalid (%lu).\n", bytes);
+        return NULL;
+    }
+    unsigned long start = pm_now_ns();
+
+    // take an allocation this thread reserved, reserving a batch from its home shard if it has none.
+    // It isn't brought into memory until it is first accessed.
+    pm_thread_cache_t* cache = thread_cache_size ? pm_thread_cache() : NULL;
+    if (cache) {
+        if (cache->reserved_count == 0) {
+            pm_cache_sync(cache, true, false);
+        }
+        if (cache->reserved_count > 0) {
+            page_t* page = &alloc_region[cache->reserved[--cache->reserved_count]];
+            __atomic_store_n(&page->cached, false, __ATOMIC_RELEASE);
+            pm_print_debug(debug_info, (void*) page);
+            pm_trace(PM_TRACE_MALLOC, page->alloc_idx, -1, 0, start);
+            return page;
+        }
+    }
+
+    // start at this thread's shard and move on to the next one if it has no allocations left.
+    unsigned int home = pm_home_shard();
+    for (unsigned int i = 0; i < shard_count; i++) {
+        pm_shard_t* shard = &shards[(home + i) % shard_count];
+
+        // request lock - will be released on every code path
+        pm_shard_lock(shard);
+
+        // find allocation in memory. If none left, try the next shard.
+        int alloc_idx = pm_find_alloc(shard);
+        if (alloc_idx < 0) {
+            pthread_mutex_unlock(&shard->lock);
+            continue;
+        }
+
+        // the allocation holds '\0' and gets a page in memory when it is first written, so allocating
+        // never evicts a page.
+        page_t new_page = { alloc_idx, -1, false, -1, -1, -1, -1, 0, false, false, false };
+        page_t* new_page_ptr = &alloc_region[alloc_idx];
+        *new_page_ptr = new_page;
+
+        // mark allocation as used
+        pm_bitmap_set(&shard->avail_allocs, alloc_idx - shard->alloc_base);
+
+        // unlock, print debug info
+        pm_print_debug(debug_info, (void*) new_page_ptr);
+        pthread_mutex_unlock(&shard->lock);
+        pm_trace(PM_TRACE_MALLOC, alloc_idx, -1, 0, start);
+        return new_page_ptr;
+    }
+
+    PM_STAT_ADD(alloc_failures, 1);
+    pm_trace(PM_TRACE_MALLOC, -1, -1, 0, start);
+    return NULL;
+}
+
+unsigned long pm_malloc_batch(unsigned long n, const unsigned long* sizes, page_t** out) {
+    // Validate the size of every request before allocating any.
+    for (unsigned long i = 0; i < n; i++) {
+        out[i] = NULL;
+    }
+    for (unsigned long i = 0; i < n; i++) {
+        if (sizes[i] > page_size) {
+            printf("Error pm_malloc_batch(): requested allocation size is invalid (%lu).\n", sizes[i]);
+            return 0;
+        }
+    }
+    unsigned long start = pm_now_ns();
+
+    // start at this thread's shard and move on to the next one if it has no allocations left.
+    unsigned long allocated = 0;
+    unsigned int home = pm_home_shard();
+    for (unsigned int i = 0; i < shard_count && allocated < n; i++) {
+        pm_shard_t* shard = &shards[(home + i) % shard_count];
+        pm_shard_lock(shard);
+
+        // take as much of the batch as the shard has allocations for. Like pm_malloc, they hold '\0' and
+        // get pages in memory when they are first written.
+        while (allocated < n) {
+            int alloc_idx = pm_find_alloc(shard);
+            if (alloc_idx < 0) {
+                break;
+            }
+            pm_bitmap_set(&shard->avail_allocs, alloc_idx - shard->alloc_base);
+            alloc_region[alloc_idx] = (page_t) { alloc_idx, -1, false, -1, -1, -1, -1, 0, false, false, false };
+            out[allocated++] = &alloc_region[alloc_idx];
+            pm_trace(PM_TRACE_MALLOC, alloc_idx, -1, 0, start);
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    if (allocated < n) {
+        PM_STAT_ADD(alloc_failures, n - allocated);
+    }
+    return allocated;
+}
+
+void pm_free(page_t* ptr, debug_t* debug_info) {
+    // a thread with a cache frees the allocations of its home shard in batches.
+    unsigned long start = pm_now_ns();
+    if (thread_cache_size && pm_cache_free(ptr, debug_info)) {
+        pm_trace(PM_TRACE_FREE, ptr - alloc_region, -1, 0, start);
+        return;
+    }
+
+    // Validate that ptr points to a correct page_t address. The lock will be released on every code path.
+    pm_shard_t* shard = pm_lock_alloc(ptr, "pm_free");
+    if (!shard) {
+        return;
+    }
+
+    // a pinned page's bytes may still be in use by the caller.
+    if (ptr->pin_count > 0) {
+        printf("Error pm_free(): page is pinned.\n");
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    int borrowed_page_idx = pm_release_alloc(shard, ptr);
+
+    // mark allocation space as available.
+    unsigned int alloc_idx = ptr->alloc_idx;
+    pm_bitmap_clear(&shard->avail_allocs, alloc_idx - shard->alloc_base);
+
+    pm_print_debug(debug_info, ptr);
+
+    // reset page_t pointed to by ptr. It is no longer in memory.
+    memset(&alloc_region[alloc_idx], '\0', sizeof(page_t));
+    alloc_region[alloc_idx].page_idx = -1;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    // a page borrowed from another shard goes back to it once this shard's lock is released.
+    if (borrowed_page_idx >= 0) {
+        pm_return_page(borrowed_page_idx);
+    }
+    pm_trace(PM_TRACE_FREE, alloc_idx, -1, 0, start);
+}
+
+unsigned long pm_free_batch(unsigned long n, page_t** ptrs) {
+    // sorting by address groups the allocations by shard, since each shard owns a range of them.
+    page_t** sorted = malloc(n * sizeof(page_t*));
+    int* borrowed = malloc(n * sizeof(int));
+    if (n > 0 && (!sorted || !borrowed)) {
+        printf("Error pm_free_batch(): out of memory.\n");
+        free(sorted);
+        free(borrowed);
+        return 0;
+    }
+    unsigned long start = pm_now_ns();
+    memcpy(sorted, ptrs, n * sizeof(page_t*));
+    qsort(sorted, n, sizeof(page_t*), pm_cmp_ptr);
+
+    unsigned long freed = 0;
+    unsigned long i = 0;
+    while (i < n) {
+        long alloc_idx = pm_alloc_index(sorted[i]);
+        if (alloc_idx < 0) {
+            printf("Error pm_free_batch(): page_t* arg does not point to a valid address.\n");
+            i++;
+            continue;
+        }
+
+        // free every allocation of this shard under one lock.
+        pm_shard_t* shard = pm_alloc_shard(alloc_idx);
+        pm_shard_lock(shard);
+        int returns = 0;
+        for (; i < n; i++) {
+            page_t* ptr = sorted[i];
+            alloc_idx = pm_alloc_index(ptr);
+            if (alloc_idx >= 0 && pm_alloc_shard(alloc_idx) != shard) {
+                break;
+            }
+            if (alloc_idx < 0 || !pm_bitmap_test(&shard->avail_allocs, alloc_idx - shard->alloc_base)
+                    || __atomic_load_n(&ptr->cached, __ATOMIC_ACQUIRE)) {
+                printf("Error pm_free_batch(): page_t* arg does not point to a valid address.\n");
+                continue;
+            }
+            if (ptr->pin_count > 0) {
+                printf("Error pm_free_batch(): page is pinned.\n");
+                continue;
+            }
+
+            int borrowed_page_idx = pm_release_alloc(shard, ptr);
+            if (borrowed_page_idx >= 0) {
+                borrowed[returns++] = borrowed_page_idx;
+            }
+            pm_bitmap_clear(&shard->avail_allocs, alloc_idx - shard->alloc_base);
+            memset(ptr, '\0', sizeof(page_t));
+            ptr->page_idx = -1;
+            pm_trace(PM_TRACE_FREE, alloc_idx, -1, 0, start);
+            freed++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        // pages borrowed from other shards go back once this shard's lock is released.
+        for (int r = 0; r < returns; r++) {
+            pm_return_page(borrowed[r]);
+        }
+    }
+
+    free(sorted);
+    free(borrowed);
+    return freed;
+}
+
+unsigned long pm_prefetch(unsigned long n, page_t** ptrs) {
+    // sorting by address groups the allocations by shard, since each shard owns a range of them.
+    page_t** sorted = malloc(n * sizeof(page_t*));
+    if (n > 0 && !sorted) {
+        printf("Error pm_prefetch(): out of memory.\n");
+        return 0;
+    }
+    memcpy(sorted, ptrs, n * sizeof(page_t*));
+    qsort(sorted, n, sizeof(page_t*), pm_cmp_ptr);
+
+    unsigned long loaded = 0;
+    unsigned long i = 0;
+    while (i < n) {
+        long alloc_idx = pm_alloc_index(sorted[i]);
+        if (alloc_idx < 0) {
+            printf("Error pm_prefetch(): page_t* arg does not point to a valid address.\n");
+            i++;
+            continue;
+        }
+
+        // bring this shard's allocations in under one lock, READAHEAD_MAX at a time, until it has no page left.
+        pm_shard_t* shard = pm_alloc_shard(alloc_idx);
+        pm_shard_lock(shard);
+        page_t* pages[READAHEAD_MAX];
+        int count = 0;
+        bool full = false;
+        for (; i < n; i++) {
+            page_t* ptr = sorted[i];
+            alloc_idx = pm_alloc_index(ptr);
+            if (alloc_idx >= 0 && pm_alloc_shard(alloc_idx) != shard) {
+                break;
+            }
+            if (alloc_idx < 0 || !pm_bitmap_test(&shard->avail_allocs, alloc_idx - shard->alloc_base)
+                    || __atomic_load_n(&ptr->cached, __ATOMIC_ACQUIRE)) {
+                printf("Error pm_prefetch(): page_t* arg does not point to a valid address.\n");
+                continue;
+            }
+            if (full || ptr->page_idx >= 0 || pm_zero_alloc(ptr) || (count > 0 && pages[count - 1] == ptr)) {
+                continue;
+            }
+
+            pages[count++] = ptr;
+            if (count == READAHEAD_MAX) {
+                int done = pm_prefetch_pages(shard, pages, count, NULL);
+                loaded += done;
+                full = done < count;
+                count = 0;
+            }
+        }
+        if (count > 0) {
+            loaded += pm_prefetch_pages(shard, pages, count, NULL);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    free(sorted);
+    return loaded;
+}
+
+char pm_access(page_t* ptr, int pos, debug_t* debug_info) {
+    // check for invalid position.
+    if (pos < 0 || (unsigned long) pos >= page_size) {
+        printf("Error pm_access(): pos arg is invalid (%d).\n", pos);
+        return '\0';
+    }
+
+    // resident pages are read without the lock, unless the heap state needs to be printed.
+    unsigned long start = pm_now_ns();
+    char result;
+    if (!debug_info && pm_read_optimistic(ptr, pos, &result, 1)) {
+        pm_trace(PM_TRACE_ACCESS, ptr - alloc_region, pos, PM_TRACE_LOCKLESS, start);
+        return result;
+    }
+
+    pm_shard_t* shard;
+    char* page = pm_lock_page(ptr, "pm_access", true, &shard);
+    if (!page) {
+        return '\0';
+    }
+
+    // get char at position.
+    result = page[pos];
+    
+    pm_print_debug(debug_info, ptr);
+    pthread_mutex_unlock(&shard->lock);
+    pm_trace(PM_TRACE_ACCESS, ptr - alloc_region, pos, 0, start);
+    return result;
+}
+
+void pm_put(page_t* ptr, int pos, char val, debug_t* debug_info) {
+    // check for invalid position.
+    if (pos < 0 || (unsigned long) pos >= page_size) {
+        printf("Error pm_put(): pos arg is invalid (%d).\n", pos);
+        return;
+    }
+
+    unsigned long start = pm_now_ns();
+    pm_shard_t* shard;
+    char* page = pm_lock_page(ptr, "pm_put", false, &shard);
+    if (!page) {
+        return;
+    }
+
+    // update char at pos, set dirty.
+    pm_seq_begin(ptr->page_idx);
+    page[pos] = val;
+    pm_seq_end(ptr->page_idx);
+    pm_mark_dirty(ptr, pos, 1);
+
+    pm_print_debug(debug_info, ptr);
+    pthread_mutex_unlock(&shard->lock);
+    pm_trace(PM_TRACE_PUT, ptr - alloc_region, pos, 0, start);
+}
+
+pm_obj_t pm_obj_malloc(unsigned long bytes) {
+    if (bytes == 0) {
+        printf("Error pm_obj_malloc(): requested object size is invalid (0).\n");
+        return 0;
+    }
+
+    // objects of up to half a page share the pages of their size class.
+    unsigned int size_class = 0;
+    while (size_class < obj_classes && (OBJ_MIN << size_class) < bytes) {
+        size_class++;
+    }
+    if (size_class == obj_classes) {
+        return pm_span_malloc(bytes);
+    }
+
+    pm_slab_class_t* cls = &slab_classes[pm_home_shard() * OBJ_CLASSES + size_class];
+    pthread_mutex_lock(&cls->lock);
+    pm_obj_t obj = pm_slab_take(cls, size_class);
+    pthread_mutex_unlock(&cls->lock);
+    return obj;
+}
 
-// split physical memory into four regions: pages, allocation structures, available pages, available allocations
-static char pm_heap[(HEAP_PAGES * PAGE_SIZE) + ((HEAP_PAGES + DISK_PAGES) * sizeof(page_t)) + HEAP_PAGES + (HEAP_PAGES + DISK_PAGES)];
+void pm_obj_free(pm_obj_t obj) {
+    long alloc_idx = OBJ_ALLOC(obj);
+    unsigned int size_class = OBJ_CLASS(obj);
+    unsigned int slot = OBJ_SLOT(obj);
+    if (!pm_heap || alloc_idx < 0 || (unsigned long) alloc_idx >= total_allocs) {
+        printf("Error pm_obj_free(): object is invalid.\n");
+        return;
+    }
 
-// Counter used to keep track of page access.
-static unsigned long lru_counter;
+    // wait for copies of objects of the allocation to finish, and keep new ones out until it's updated.
+    pm_shard_t* shard = pm_alloc_shard(alloc_idx);
+    pthread_rwlock_wrlock(&shard->obj_lock);
 
-//------------ Helper functions not declared in pm_heap.h ---------------------//
+    // an object of whole pages frees them all. Taking it out of obj_spans first catches a double free.
+    if (size_class == OBJ_SPAN) {
+        pm_span_t* span = slot == 0 ? __atomic_exchange_n(&obj_spans[alloc_idx], NULL, __ATOMIC_ACQ_REL) : NULL;
+        pthread_rwlock_unlock(&shard->obj_lock);
+        if (!span) {
+            printf("Error pm_obj_free(): object is invalid.\n");
+            return;
+        }
+        pm_free_batch(span->count, span->pages);
+        free(span);
+        return;
+    }
 
-/**
- * Find open page in page region of memory. NOTE: does not mark as used.
- * 
- * @return the page index for an unused page in memory or -1 if can't be found.
-*/
-int pm_find_page() {
-    // search for unused page (denoted with '\0').
-    for (int p = 0; p < HEAP_PAGES; p++) {
-        if (pm_heap[AVAIL_PAGE_OFFSET + p] == '\0') {
-            return p;
+    pm_slab_t* slab = __atomic_load_n(&obj_slabs[alloc_idx], __ATOMIC_ACQUIRE);
+    if (!slab || slab->size_class != size_class || slot >= slab->cls->slots) {
+        printf("Error pm_obj_free(): object is invalid.\n");
+        pthread_rwlock_unlock(&shard->obj_lock);
+        return;
+    }
+
+    pm_slab_class_t* cls = slab->cls;
+    pthread_mutex_lock(&cls->lock);
+    uint64_t bit = 1ULL << (slot % 64);
+    if (!(slab->used_map[slot / 64] & bit)) {
+        printf("Error pm_obj_free(): object is not allocated.\n");
+        pthread_mutex_unlock(&cls->lock);
+        pthread_rwlock_unlock(&shard->obj_lock);
+        return;
+    }
+    slab->used_map[slot / 64] &= ~bit;
+    if (slot / 64 < slab->hint) {
+        slab->hint = slot / 64;
+    }
+
+    // a full page goes back on the class's list.
+    if (slab->used-- == cls->slots) {
+        slab->prev = NULL;
+        slab->next = cls->partial;
+        if (cls->partial) {
+            cls->partial->prev = slab;
         }
+        cls->partial = slab;
     }
 
-    return -1;
+    // keep an empty page if the class has no other room, so objects allocated and freed in turn don't
+    // allocate and free a page each time.
+    if (slab->used > 0 || (cls->partial == slab && !slab->next)) {
+        pthread_mutex_unlock(&cls->lock);
+        pthread_rwlock_unlock(&shard->obj_lock);
+        return;
+    }
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        cls->partial = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    __atomic_store_n(&obj_slabs[alloc_idx], NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cls->lock);
+    pthread_rwlock_unlock(&shard->obj_lock);
+
+    pm_free(slab->page, NULL);
+    free(slab);
 }
 
-/**
- * Find open page in the allocation region of memory. NOTE: does not mark as used.
- * 
- * @return the index of the first page in the contiguous set of pages or -1 if can't be found.
-*/
-int pm_find_alloc() {
-    // search for unused allocation space (denoted with '\0').
-    for (int p = 0; p < HEAP_PAGES + DISK_PAGES; p++) {
-        if (pm_heap[AVAIL_ALLOC_OFFSET + p] == '\0') {
-            return p;
-        }
+bool pm_obj_read(pm_obj_t obj, unsigned long off, void* dst, unsigned long len) {
+    return pm_obj_copy(obj, off, dst, len, false, "pm_obj_read");
+}
+
+bool pm_obj_write(pm_obj_t obj, unsigned long off, const void* src, unsigned long len) {
+    return pm_obj_copy(obj, off, (char*) src, len, true, "pm_obj_write");
+}
+
+bool pm_read(page_t* ptr, unsigned long off, void* dst, unsigned long len, debug_t* debug_info) {
+    // check for invalid range.
+    if (pm_invalid_range(off, len)) {
+        printf("Error pm_read(): range is invalid (off=%lu, len=%lu).\n", off, len);
+        return false;
     }
 
-    return -1;
+    // resident pages are read without the lock, unless the heap state needs to be printed.
+    unsigned long start = pm_now_ns();
+    if (!debug_info && pm_read_optimistic(ptr, off, dst, len)) {
+        pm_trace(PM_TRACE_ACCESS, ptr - alloc_region, off, PM_TRACE_LOCKLESS, start);
+        return true;
+    }
+
+    pm_shard_t* shard;
+    char* page = pm_lock_page(ptr, "pm_read", true, &shard);
+    if (!page) {
+        return false;
+    }
+
+    // copy the whole range out in one go.
+    memcpy(dst, page + off, len);
+
+    pm_print_debug(debug_info, ptr);
+    pthread_mutex_unlock(&shard->lock);
+    pm_trace(PM_TRACE_ACCESS, ptr - alloc_region, off, 0, start);
+    return true;
 }
 
-/**
- * Record the current value of the lru_counter to this page_t and then increment the lru_counter.
- *
- * @param page the page to record to.
- */
-void pm_record_lru_counter(page_t* page) {
-    page->lru_count = lru_counter++;
+bool pm_write(page_t* ptr, unsigned long off, const void* src, unsigned long len, debug_t* debug_info) {
+    // check for invalid range.
+    if (pm_invalid_range(off, len)) {
+        printf("Error pm_write(): range is invalid (off=%lu, len=%lu).\n", off, len);
+        return false;
+    }
+
+    unsigned long start = pm_now_ns();
+    pm_shard_t* shard;
+    char* page = pm_lock_page(ptr, "pm_write", false, &shard);
+    if (!page) {
+        return false;
+    }
+
+    // copy the whole range in one go, set dirty.
+    pm_seq_begin(ptr->page_idx);
+    memcpy(page + off, src, len);
+    pm_seq_end(ptr->page_idx);
+    pm_mark_dirty(ptr, off, len);
+
+    pm_print_debug(debug_info, ptr);
+    pthread_mutex_unlock(&shard->lock);
+    pm_trace(PM_TRACE_PUT, ptr - alloc_region, off, 0, start);
+    return true;
 }
 
-/**
- * Choose a page to page out based on the least-recently-used (LRU) strategy.
- *
- * @return the pointer of the page that should be saved to disk.
- */
-page_t* pm_lru_page() {
-    // Find the page in memory with the lowest lru_count value.
-    unsigned long min_lru_count = lru_counter + 1;
-    page_t* page_to_remove = NULL;
-    for (int i = 0; i < HEAP_PAGES + DISK_PAGES; i++) {
-        // Check if there is a page in memory at this index.
-        if (pm_heap[AVAIL_ALLOC_OFFSET + i] != '\0') {
-            page_t* current_page = (page_t*) (&pm_heap[ALLOC_OFFSET + (i * sizeof(page_t))]);
-            if (current_page->page_idx >= 0 && current_page->lru_count < min_lru_count) {
-                min_lru_count = current_page->lru_count;
-                page_to_remove = current_page;
-            }
-        }
+bool pm_memset(page_t* ptr, unsigned long off, char val, unsigned long len, debug_t* debug_info) {
+    // check for invalid range.
+    if (pm_invalid_range(off, len)) {
+        printf("Error pm_memset(): range is invalid (off=%lu, len=%lu).\n", off, len);
+        return false;
+    }
+
+    unsigned long start = pm_now_ns();
+    pm_shard_t* shard;
+    char* page = pm_lock_page(ptr, "pm_memset", false, &shard);
+    if (!page) {
+        return false;
     }
 
-    return page_to_remove;
+    // set the whole range in one go, set dirty.
+    pm_seq_begin(ptr->page_idx);
+    memset(page + off, val, len);
+    pm_seq_end(ptr->page_idx);
+    pm_mark_dirty(ptr, off, len);
+
+    pm_print_debug(debug_info, ptr);
+    pthread_mutex_unlock(&shard->lock);
+    pm_trace(PM_TRACE_PUT, ptr - alloc_region, off, 0, start);
+    return true;
 }
 
-/**
- * Save page to disk.
- *
- * @param page_to_evict the page to save.
- */
-void pm_page_out(page_t* page_to_evict) {
-    // if page isn't dirty, don't need to rewrite to memory.
-    if (!page_to_evict->dirty) {
-        memset(&pm_heap[page_to_evict->page_idx * PAGE_SIZE], '\0', PAGE_SIZE);
-        page_to_evict->page_idx = -1;
-        return;
+bool pm_access_async(page_t* ptr, unsigned long off, unsigned long len, pm_access_cb_t cb, void* ctx) {
+    // check for invalid arguments.
+    if (pm_invalid_range(off, len)) {
+        printf("Error pm_access_async(): range is invalid (off=%lu, len=%lu).\n", off, len);
+        return false;
+    }
+    if (pm_alloc_index(ptr) < 0) {
+        printf("Error pm_access_async(): page_t* arg does not point to a valid address.\n");
+        return false;
+    }
+    if (!cb) {
+        printf("Error pm_access_async(): callback is NULL.\n");
+        return false;
     }
 
-    // naming strategy is always pgX where X is the Xth page in allocation section.
-    char filename[16];
-    sprintf(filename, "%s/pg%d.bin", DISK_DIR, page_to_evict->alloc_idx);
+    pm_async_req_t* req = malloc(sizeof(pm_async_req_t) + len);
+    if (!req) {
+        printf("Error pm_access_async(): out of memory.\n");
+        return false;
+    }
 
-    // open file to write to
-    FILE* file = fopen(filename, "wb");
-    if (file == NULL) {
-        printf("Error pm_page_out(): couldn't open file, unable to write contents to disk for page %d\n", page_to_evict->alloc_idx);
-        return;
+    // resident pages are served right away.
+    unsigned long start = pm_now_ns();
+    if (pm_read_optimistic(ptr, off, req->data, len)) {
+        pm_trace(PM_TRACE_ACCESS, ptr - alloc_region, off, PM_TRACE_LOCKLESS, start);
+        cb(ptr, req->data, len, ctx);
+        free(req);
+        return true;
     }
 
-    // write page contents to disk.
-    fwrite(&pm_heap[page_to_evict->page_idx * PAGE_SIZE], sizeof(char), PAGE_SIZE, file);
-    fclose(file);
+    req->next = NULL;
+    req->ptr = ptr;
+    req->off = off;
+    req->len = len;
+    req->cb = cb;
+    req->ctx = ctx;
+
+    pthread_mutex_lock(&async_lock);
 
-    // reset page in memory and fields for this allocation.
-    memset(&pm_heap[page_to_evict->page_idx * PAGE_SIZE], '\0', PAGE_SIZE);
-    page_to_evict->dirty = false;
-    page_to_evict->page_idx = -1;
+    // start the workers on the first fault.
+    if (!async_started && !async_stop) {
+        async_threads = malloc(async_workers * sizeof(pthread_t));
+        while (async_threads && async_started < async_workers
+                && pthread_create(&async_threads[async_started], NULL, pm_async_worker, NULL) == 0) {
+            async_started++;
+        }
+    }
+    if (!async_started) {
+        pthread_mutex_unlock(&async_lock);
+        printf("Error pm_access_async(): couldn't start async workers.\n");
+        free(req);
+        return false;
+    }
+
+    // queue the fault for the next idle worker.
+    if (async_tail) {
+        async_tail->next = req;
+    } else {
+        async_head = req;
+    }
+    async_tail = req;
+    pthread_cond_signal(&async_cond);
+
+    pthread_mutex_unlock(&async_lock);
+    return true;
 }
 
-/**
- * Bring page from memory back into heap.
- *
- * @param page the page to bring into memory.
- * @param page_idx the index of where in memory the page should be placed.
- */
-void pm_load_from_disk(page_t* page, int page_idx) {
-    // update page_idx (now in memory)
-    page->page_idx = page_idx;
+char* pm_pin(page_t* ptr, bool writable) {
+    unsigned long start = pm_now_ns();
+    pm_shard_t* shard;
+    char* page = pm_lock_page(ptr, "pm_pin", false, &shard);
+    if (!page) {
+        return NULL;
+    }
 
-    // naming strategy is always pgX where X is the Xth page in allocation section.
-    char filename[16];
-    sprintf(filename, "%s/pg%d.bin", DISK_DIR, page->alloc_idx);
+    // take the page off the policy's lists so it can't be evicted while pinned.
+    if (ptr->pin_count == 0) {
+        pm_list_remove(shard, ptr);
+    }
+    ptr->pin_count++;
 
-    // open file to read from.
-    FILE* file = fopen(filename, "rb");
-    if (file == NULL) {
-        // reset page contents to '\0' by default.
-        memset(&pm_heap[page_idx * PAGE_SIZE], '\0', PAGE_SIZE);
-        printf("Error pm_load_from_disk(): Couldn't open file, unable to read contents from disk into memory for alloc %d\n", page->alloc_idx);
+    // the caller may write through the pointer at any time, so assume it does. Moving the sequence
+    // also stops a write back that is in flight from marking the page clean.
+    if (writable) {
+        pm_mark_dirty(ptr, 0, page_size);
+        pm_seq_begin(ptr->page_idx);
+        pm_seq_end(ptr->page_idx);
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    pm_trace(writable ? PM_TRACE_PUT : PM_TRACE_ACCESS, ptr - alloc_region, 0, 0, start);
+    return page;
+}
+
+void pm_unpin(page_t* ptr) {
+    // check for an invalid page_t ptr.
+    pm_shard_t* shard = pm_lock_alloc(ptr, "pm_unpin");
+    if (!shard) {
         return;
     }
 
-    // see how large file is (should be size of a page).
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    if (file_size != PAGE_SIZE) {
-        // reset page contents to '\0' by default.
-        memset(&pm_heap[page_idx * PAGE_SIZE], '\0', PAGE_SIZE);
-        printf("Error pm_load_from_disk(): Size of page on disk is not equal to configured page size for alloc %d\n", page->alloc_idx);
+    if (ptr->pin_count == 0) {
+        printf("Error pm_unpin(): page is not pinned.\n");
+        pthread_mutex_unlock(&shard->lock);
         return;
     }
-    fseek(file, 0, SEEK_SET);
 
-    // read disk contents into memory.
-    fread(&pm_heap[page_idx * PAGE_SIZE], PAGE_SIZE, 1, file);
+    // the last unpin makes the page evictable again, as if it was just brought into memory.
+    ptr->pin_count--;
+    if (ptr->pin_count == 0) {
+        policy->insert(shard, ptr);
+    }
 
-    fclose(file);
+    pthread_mutex_unlock(&shard->lock);
 }
 
-/**
- * If page is not current in memory, bring into memory by finding open page or evicting a page in memory.
- * 
- * @param page the page to potentially bring into memory from disk.
-*/
-void pm_load_alloc(page_t* page) {
-    if (page->page_idx < 0) {
-        // check if open page in memory.
-        int open_page_idx = pm_find_page();
+void pm_thread_cache_flush() {
+    pm_thread_cache_t* cache = thread_cache;
+    if (cache && cache->generation == heap_generation && (cache->reserved_count > 0 || cache->freed_count > 0)) {
+        pm_cache_sync(cache, false, true);
+    }
+}
 
-        // if no open page, evict a page currently in memory.
-        if (open_page_idx < 0) {
-            page_t *page_to_evict = pm_lru_page();
-            open_page_idx = page_to_evict->page_idx;
-            pm_page_out(page_to_evict);
+bool pm_checkpoint() {
+    if (!persist) {
+        printf("Error pm_checkpoint(): heap was not initialized with pm_config_t.persist.\n");
+        return false;
+    }
+
+    pm_lock_all();
+
+    // every allocation's contents must be in the swap file: write back dirty pages in memory and
+    // empty the compressed pool. Pinned pages may still be written through, so they stay dirty.
+    bool written = true;
+    for (unsigned int s = 0; s < shard_count; s++) {
+        pm_shard_t* shard = &shards[s];
+        for (unsigned long a = shard->alloc_base; a < shard->alloc_base + shard->alloc_count; a++) {
+            page_t* page = &alloc_region[a];
+            unsigned long bit = a - shard->alloc_base;
+            if (!((shard->avail_allocs.words[bit / 64] >> (bit % 64)) & 1) || page->page_idx < 0 || !page->dirty
+                    || __atomic_load_n(&page->cached, __ATOMIC_RELAXED)) {
+                continue;
+            }
+            int slot = pm_swap_slot(shard, page);
+            if (slot < 0 || !pm_swap_write_blocks(&pm_heap[page->page_idx * page_size], slot, dirty_blocks[page->page_idx])) {
+                printf("Error pm_checkpoint(): unable to write contents to disk for page %d\n", page->alloc_idx);
+                written = false;
+            } else if (page->pin_count == 0) {
+                page->dirty = false;
+                dirty_blocks[page->page_idx] = 0;
+                if (dedup) {
+                    pm_dedup_add(shard, slot, pm_page_hash(&pm_heap[page->page_idx * page_size]));
+                }
+            }
         }
+        while (zpool_bytes && shard->ztail >= 0) {
+            pm_zpool_write_back(shard);
+        }
+    }
 
-        // mark page as in use
-        pm_heap[AVAIL_PAGE_OFFSET + open_page_idx] = '1';
+    bool saved = false;
+    if (!written || (swap_map ? msync(swap_map, total_allocs * page_size, MS_SYNC) : fsync(swap_fd)) != 0) {
+        printf("Error pm_checkpoint(): unable to sync %s.\n", swap_filename);
+    } else {
+        saved = pm_meta_save();
+    }
 
-        // load contents back into memory
-        pm_load_from_disk(page, open_page_idx);
+    for (unsigned int s = 0; s < shard_count; s++) {
+        pthread_mutex_unlock(&shards[s].lock);
     }
+    return saved;
 }
 
-/**
- * Print internal state of the heap.
- *
- * @param debug_info the debug info to print with.
- * @param ptr the pointer to print with.
- */
-void pm_print_debug(debug_t* debug_info, void* ptr) {
-    if (debug_info) {
-        printf("%s (%p)\n", debug_info->completionMsg, ptr);
-        pm_print_heap();
-        pm_print_allocations();
+page_t* pm_attach(unsigned int alloc_idx) {
+    if (alloc_idx >= total_allocs) {
+        printf("Error pm_attach(): allocation %u is out of range.\n", alloc_idx);
+        return NULL;
     }
-}
 
-/**
- * Determine if the given ptr is a valid page_t structure.
- * 
- * @param ptr the pointer to evaluate.
- * @return true if valid pointer, false otherwise.
-*/
-bool pm_invalid_alloc(page_t* ptr) {
-    if (!ptr) {
-        return false;
+    pm_shard_t* shard = pm_alloc_shard(alloc_idx);
+    unsigned long bit = alloc_idx - shard->alloc_base;
+    if (!((__atomic_load_n(&shard->avail_allocs.words[bit / 64], __ATOMIC_RELAXED) >> (bit % 64)) & 1)
+            || __atomic_load_n(&alloc_region[alloc_idx].cached, __ATOMIC_RELAXED)) {
+        return NULL;
     }
 
-    unsigned long heap_idx = ((void*) ptr) - ((void*) pm_heap);
+    return &alloc_region[alloc_idx];
+}
 
-    return heap_idx < ALLOC_OFFSET
-        || heap_idx > AVAIL_PAGE_OFFSET
-        || (heap_idx - ALLOC_OFFSET) % sizeof(page_t) != 0
-        || ptr->lru_count == 0;
+void pm_init() {
+    pm_init_config(NULL);
 }
 
-//------------ Functions declared in pm_heap.h ---------------------//
+bool pm_init_config(const pm_config_t* config) {
+    pm_config_t geometry = { .page_size = PAGE_SIZE, .heap_pages = HEAP_PAGES, .disk_pages = DISK_PAGES, .disk_dir = DISK_DIR, .shards = 1 };
+    if (config) {
+        geometry.page_size = config->page_size ? config->page_size : PAGE_SIZE;
+        geometry.heap_pages = config->heap_pages ? config->heap_pages : HEAP_PAGES;
+        geometry.disk_pages = config->disk_pages;
+        geometry.disk_dir = config->disk_dir ? config->disk_dir : DISK_DIR;
+        geometry.shards = config->shards ? config->shards : 1;
+        geometry.steal = config->steal;
+        geometry.flusher = config->flusher;
+        geometry.flush_watermark = config->flush_watermark;
+        geometry.async_workers = config->async_workers;
+        geometry.policy = config->policy;
+        geometry.zpool_bytes = config->zpool_bytes;
+        geometry.persist = config->persist;
+        geometry.swap_mmap = config->swap_mmap;
+        geometry.thread_cache = config->thread_cache;
+        geometry.trace_events = config->trace_events;
+        geometry.dedup = config->dedup;
+        geometry.readahead = config->readahead;
+        geometry.evict_batch = config->evict_batch;
+    }
 
-page_t* pm_malloc(unsigned long bytes, debug_t* debug_info) {
-    // Validate the size of the request.
-    if (bytes > PAGE_SIZE) {
-        printf("Error pm_malloc(): requested allocation size is invalid (%lu).\n", bytes);
-        return NULL;
+    // every index must fit in page_t's int/unsigned int fields.
+    if (geometry.heap_pages > INT_MAX || geometry.disk_pages > INT_MAX - geometry.heap_pages) {
+        printf("Error pm_init_config(): too many pages (%lu heap, %lu disk).\n", geometry.heap_pages, geometry.disk_pages);
+        return false;
+    }
+    if (geometry.page_size > ULONG_MAX / geometry.heap_pages) {
+        printf("Error pm_init_config(): page size is too large (%lu).\n", geometry.page_size);
+        return false;
+    }
+    if (strlen(geometry.disk_dir) >= sizeof(disk_dir)) {
+        printf("Error pm_init_config(): disk directory name is too long.\n");
+        return false;
+    }
+    if (geometry.trace_events > (1UL << 30)) {
+        printf("Error pm_init_config(): too many trace events per thread (%lu).\n", geometry.trace_events);
+        return false;
+    }
+    if (geometry.readahead > READAHEAD_MAX) {
+        printf("Error pm_init_config(): too many pages to read ahead (%u).\n", geometry.readahead);
+        return false;
+    }
+    if (geometry.evict_batch > EVICT_BATCH_MAX) {
+        printf("Error pm_init_config(): too many pages to evict at once (%u).\n", geometry.evict_batch);
+        return false;
+    }
+    if ((unsigned int) geometry.policy >= sizeof(policies) / sizeof(policies[0])) {
+        printf("Error pm_init_config(): unknown replacement policy (%d).\n", geometry.policy);
+        return false;
     }
 
-    // request lock - will be released on every code path
-    pthread_mutex_lock(&lock);
+    // every shard needs at least one page in memory.
+    if (geometry.shards > geometry.heap_pages) {
+        geometry.shards = geometry.heap_pages;
+    }
 
-    // find allocation in memory. If none left, return NULL.
-    int alloc_idx = pm_find_alloc();
-    if (alloc_idx < 0) {
-        pthread_mutex_unlock(&lock);
-        return NULL;
+    pthread_mutex_lock(&init_lock);
+
+    if (pm_heap) {
+        printf("Error pm_init_config(): heap is already initialized.\n");
+        pthread_mutex_unlock(&init_lock);
+        return false;
     }
 
-    // find page in memory. If none left, evict an existing page in memory.
-    int page_idx = pm_find_page();
-    if (page_idx < 0) {
-        // select which page to evict using the LRU strategy.
-        page_t* page_to_evict = pm_lru_page();
-        page_idx = page_to_evict->page_idx;
-        pm_page_out(page_to_evict);
+    unsigned long allocs = geometry.heap_pages + geometry.disk_pages;
+
+    // pages go first so every page starts on a page boundary. Align to the page size itself
+    // when it is a power of two larger than the system page (e.g. 2 MiB pages).
+    unsigned long align = sysconf(_SC_PAGESIZE);
+    if (geometry.page_size > align && (geometry.page_size & (geometry.page_size - 1)) == 0) {
+        align = geometry.page_size;
     }
 
-    // create new page_num in pm_heap - set dirty initially
-    page_t new_page = { alloc_idx, page_idx, true, lru_counter++ };
-    page_t* new_page_ptr = (page_t*) (&pm_heap[ALLOC_OFFSET + (alloc_idx * sizeof(page_t))]);
-    *new_page_ptr = new_page;
+    // regions: pages, allocation structures, shards, and each shard's available pages, available
+    // allocations and available swap slots.
+    unsigned long pages_bytes = ALIGN64(geometry.page_size * geometry.heap_pages);
+    unsigned long allocs_bytes = ALIGN64(allocs * sizeof(page_t));
+    unsigned long seqs_bytes = ALIGN64(geometry.heap_pages * sizeof(unsigned int))
+        + ALIGN64(geometry.heap_pages * sizeof(uint64_t));
+    unsigned long shards_bytes = geometry.shards * sizeof(pm_shard_t);
+    unsigned long bitmaps_bytes = 0;
+    unsigned long buckets_total = 0;
+    unsigned long zchunk_total = geometry.zpool_bytes / ZPOOL_CHUNK;
+    for (unsigned int s = 0; s < geometry.shards; s++) {
+        unsigned long shard_pages = (s + 1) * geometry.heap_pages / geometry.shards - s * geometry.heap_pages / geometry.shards;
+        unsigned long shard_allocs = (s + 1) * allocs / geometry.shards - s * allocs / geometry.shards;
+        unsigned long shard_zchunks = (s + 1) * zchunk_total / geometry.shards - s * zchunk_total / geometry.shards;
+        bitmaps_bytes += pm_bitmap_bytes(shard_pages) + 2 * pm_bitmap_bytes(shard_allocs) + pm_bitmap_bytes(shard_zchunks);
+        buckets_total += pm_dedup_buckets(shard_allocs);
+    }
+    bitmaps_bytes = ALIGN64(bitmaps_bytes);
 
-    // mark page as allocated
-    pm_heap[AVAIL_ALLOC_OFFSET + alloc_idx] = '1';
-    pm_heap[AVAIL_PAGE_OFFSET + page_idx] = '1';
+    // the compressed pool, if any: an entry per allocation, the chunk chains, the chunks and scratch buffers.
+    unsigned long zentries_bytes = 0;
+    unsigned long znext_bytes = 0;
+    unsigned long zchunks_bytes = 0;
+    unsigned long zscratch_bytes = 0;
+    if (zchunk_total > 0) {
+        zentries_bytes = ALIGN64(allocs * sizeof(pm_zentry_t));
+        znext_bytes = ALIGN64(zchunk_total * sizeof(int));
+        zchunks_bytes = zchunk_total * ZPOOL_CHUNK;
+        zscratch_bytes = ALIGN64(geometry.shards * 3 * geometry.page_size);
+    }
 
-    // unlock, print debug info
-    pm_print_debug(debug_info, (void*) new_page_ptr);
-    pthread_mutex_unlock(&lock);
-    return new_page_ptr;
-}
+    // pm_obj size classes of every shard, and the slab or span held by each allocation.
+    unsigned long classes_bytes = geometry.shards * OBJ_CLASSES * sizeof(pm_slab_class_t);
+    unsigned long objs_bytes = ALIGN64(allocs * sizeof(pm_slab_t*)) + ALIGN64(allocs * sizeof(pm_span_t*));
 
-void pm_free(page_t* ptr, debug_t* debug_info) {
-    // request lock - will be released on every code path.
-    pthread_mutex_lock(&lock);
+    // the page of '\0' read in place of allocations that were never written.
+    unsigned long zero_bytes = ALIGN64(geometry.page_size);
 
-    // Validate that ptr points to a correct page_t address.
-    if (pm_invalid_alloc(ptr)) {
-        printf("Error pm_free(): page_t* arg does not point to a valid address.\n");
-        pthread_mutex_unlock(&lock);
-        return;
+    // the number of allocations in each swap slot and, with dedup, the hash of each slot, the chains of the
+    // dedup tables, their buckets and a scratch page per shard.
+    unsigned long refs_bytes = ALIGN64(allocs * sizeof(unsigned int));
+    unsigned long dedup_bytes = 0;
+    if (geometry.dedup) {
+        dedup_bytes = ALIGN64(allocs * sizeof(uint64_t)) + ALIGN64(allocs * sizeof(int))
+            + ALIGN64(buckets_total * sizeof(int)) + ALIGN64(geometry.shards * geometry.page_size);
     }
 
-    // remove disk page.
-    char filename[16];
-    sprintf(filename, "%s/pg%d.bin", DISK_DIR, ptr->alloc_idx);
-    remove(filename);
+    unsigned long size = pages_bytes + allocs_bytes + seqs_bytes + shards_bytes + bitmaps_bytes
+        + zentries_bytes + znext_bytes + zchunks_bytes + zscratch_bytes + classes_bytes + objs_bytes + zero_bytes
+        + refs_bytes + dedup_bytes;
 
-    // reset any calls to pm_put and mark page in memory as available.
-    if (ptr->page_idx >= 0) {
-        memset(&pm_heap[ptr->page_idx * PAGE_SIZE], '\0', PAGE_SIZE);
-        pm_heap[AVAIL_PAGE_OFFSET + ptr->page_idx] = '\0';
+    // over-map by the alignment and trim, so the arena start is aligned. Anonymous maps are zeroed.
+    char* mapping = mmap(NULL, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        printf("Error pm_init_config(): couldn't allocate arena of %lu bytes.\n", size);
+        pthread_mutex_unlock(&init_lock);
+        return false;
+    }
+    char* arena = (char*) (((unsigned long) mapping + align - 1) & ~(align - 1));
+    if (arena > mapping) {
+        munmap(mapping, arena - mapping);
     }
+    munmap(arena + size, (mapping + size + align) - (arena + size));
 
-    // mark allocation space as available.
-    unsigned int alloc_idx = ptr->alloc_idx;
-    pm_heap[AVAIL_ALLOC_OFFSET + alloc_idx] = '\0';
+    pm_heap = arena;
+    pm_heap_size = size;
+    page_size = geometry.page_size;
+    heap_pages = geometry.heap_pages;
+    disk_pages = geometry.disk_pages;
+    strcpy(disk_dir, geometry.disk_dir);
+    shard_count = geometry.shards;
+    steal_pages = geometry.steal;
+    flush_watermark = geometry.flush_watermark;
+    policy_kind = geometry.policy;
+    policy = &policies[policy_kind];
+    async_workers = geometry.async_workers ? geometry.async_workers : ASYNC_WORKERS;
+    zpool_bytes = zchunk_total * ZPOOL_CHUNK;
+    persist = geometry.persist;
+    dedup = geometry.dedup;
+    readahead_pages = geometry.readahead;
+    evict_batch = geometry.evict_batch;
+    thread_cache_size = geometry.thread_cache;
+    heap_generation++;
+    total_allocs = allocs;
 
-    pm_print_debug(debug_info, ptr);
+    alloc_region = (page_t*) (pm_heap + pages_bytes);
+    page_seqs = (unsigned int*) (pm_heap + pages_bytes + allocs_bytes);
+    dirty_blocks = (uint64_t*) (pm_heap + pages_bytes + allocs_bytes + ALIGN64(heap_pages * sizeof(unsigned int)));
+    dirty_block_size = page_size / 64 > DIRTY_BLOCK ? (page_size + 63) / 64 : DIRTY_BLOCK;
+    dirty_block_count = (page_size + dirty_block_size - 1) / dirty_block_size;
+    dirty_all = dirty_block_count == 64 ? ~0ULL : (1ULL << dirty_block_count) - 1;
+    shards = (pm_shard_t*) (pm_heap + pages_bytes + allocs_bytes + seqs_bytes);
 
-    // reset page_t pointed to by ptr.
-    memset(&pm_heap[ALLOC_OFFSET + (alloc_idx * sizeof(page_t))], '\0', sizeof(page_t));
+    char* zregion = pm_heap + pages_bytes + allocs_bytes + seqs_bytes + shards_bytes + bitmaps_bytes;
+    zentries = zchunk_total ? (pm_zentry_t*) zregion : NULL;
+    zchunk_next = zchunk_total ? (int*) (zregion + zentries_bytes) : NULL;
+    zchunks = zchunk_total ? zregion + zentries_bytes + znext_bytes : NULL;
+    char* zscratch = zregion + zentries_bytes + znext_bytes + zchunks_bytes;
+    for (unsigned long a = 0; zentries && a < allocs; a++) {
+        zentries[a] = (pm_zentry_t) { -1, 0, -1, -1 };
+    }
 
-    pthread_mutex_unlock(&lock);
-}
+    // size classes double from OBJ_MIN up to half a page, as long as a page's slots fit in a handle.
+    slab_classes = (pm_slab_class_t*) (zscratch + zscratch_bytes);
+    obj_slabs = (pm_slab_t**) ((char*) slab_classes + classes_bytes);
+    obj_spans = (pm_span_t**) ((char*) obj_slabs + ALIGN64(allocs * sizeof(pm_slab_t*)));
+    zero_page = (char*) slab_classes + classes_bytes + objs_bytes;
+    slot_refs = (unsigned int*) (zero_page + zero_bytes);
+    slot_hashes = dedup ? (uint64_t*) ((char*) slot_refs + refs_bytes) : NULL;
+    dedup_next = dedup ? (int*) ((char*) slot_hashes + ALIGN64(allocs * sizeof(uint64_t))) : NULL;
+    int* dedup_buckets = dedup ? (int*) ((char*) dedup_next + ALIGN64(allocs * sizeof(int))) : NULL;
+    char* dedup_scratch = dedup ? (char*) dedup_buckets + ALIGN64(buckets_total * sizeof(int)) : NULL;
+    for (unsigned long a = 0; dedup && a < allocs; a++) {
+        dedup_next[a] = DEDUP_NONE;
+    }
+    for (unsigned long b = 0; dedup && b < buckets_total; b++) {
+        dedup_buckets[b] = -1;
+    }
+    obj_classes = 0;
+    while (obj_classes < OBJ_CLASSES && (OBJ_MIN << obj_classes) <= page_size / 2
+            && page_size / (OBJ_MIN << obj_classes) <= OBJ_SLOT(~0ULL)) {
+        obj_classes++;
+    }
+    for (unsigned int c = 0; c < shard_count * OBJ_CLASSES; c++) {
+        pthread_mutex_init(&slab_classes[c].lock, NULL);
+        slab_classes[c].size = OBJ_MIN << (c % OBJ_CLASSES);
+        slab_classes[c].slots = page_size / slab_classes[c].size;
+    }
 
-char pm_access(page_t* ptr, int pos, debug_t* debug_info) {
-    pthread_mutex_lock(&lock);
+    // split the pages in memory, the allocations and the pool evenly over the shards (see pm_owner_shard).
+    uint64_t* bitmaps = (uint64_t*) (pm_heap + pages_bytes + allocs_bytes + seqs_bytes + shards_bytes);
+    for (unsigned int s = 0; s < shard_count; s++) {
+        pm_shard_t* shard = &shards[s];
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_rwlock_init(&shard->obj_lock, NULL);
+        pthread_cond_init(&shard->flush_done, NULL);
+        shard->page_base = s * heap_pages / shard_count;
+        shard->page_count = (s + 1) * heap_pages / shard_count - shard->page_base;
+        shard->alloc_base = s * total_allocs / shard_count;
+        shard->alloc_count = (s + 1) * total_allocs / shard_count - shard->alloc_base;
 
-    // check for an invalid page_t ptr.
-    if (pm_invalid_alloc(ptr)) {
-        printf("Error pm_access(): page_t* arg does not point to a valid address.\n");
-        pthread_mutex_unlock(&lock);
-        return '\0';
+        pm_bitmap_init(&shard->avail_pages, bitmaps, shard->page_count);
+        bitmaps += pm_bitmap_bytes(shard->page_count) / sizeof(uint64_t);
+        pm_bitmap_init(&shard->avail_allocs, bitmaps, shard->alloc_count);
+        bitmaps += pm_bitmap_bytes(shard->alloc_count) / sizeof(uint64_t);
+        pm_bitmap_init(&shard->avail_slots, bitmaps, shard->alloc_count);
+        bitmaps += pm_bitmap_bytes(shard->alloc_count) / sizeof(uint64_t);
+
+        shard->zchunk_base = s * zchunk_total / shard_count;
+        shard->zchunk_count = (s + 1) * zchunk_total / shard_count - shard->zchunk_base;
+        shard->zchunks_free = shard->zchunk_count;
+        pm_bitmap_init(&shard->avail_zchunks, bitmaps, shard->zchunk_count);
+        bitmaps += pm_bitmap_bytes(shard->zchunk_count) / sizeof(uint64_t);
+        shard->zhead = -1;
+        shard->ztail = -1;
+        shard->zscratch = zchunk_total ? zscratch + s * 3 * page_size : NULL;
+
+        // an empty dedup table per shard, with a bucket or more per slot.
+        shard->dedup_buckets = dedup_buckets;
+        shard->dedup_mask = dedup ? pm_dedup_buckets(shard->alloc_count) - 1 : 0;
+        shard->dedup_scratch = dedup ? dedup_scratch + s * page_size : NULL;
+        if (dedup) {
+            dedup_buckets += pm_dedup_buckets(shard->alloc_count);
+        }
+
+        // nothing is in memory yet.
+        for (int l = 0; l < PM_LISTS; l++) {
+            shard->lists[l] = (pm_list_t) { -1, -1, 0 };
+        }
+        shard->arc_target = 0;
+        shard->flush_alloc = -1;
+        shard->flush_slot = -1;
+
+        // by default, keep an eighth of the shard's pages clean.
+        shard->flush_watermark = flush_watermark ? flush_watermark : shard->page_count / 8 + 1;
     }
 
-    // check for invalid position.
-    if (pos < 0 || pos >= PAGE_SIZE) {
-        printf("Error pm_access(): pos arg is invalid (%d).\n", pos);
-        pthread_mutex_unlock(&lock);
-        return '\0';
+    // create directory for pages on disk.
+    struct stat st = {0};
+
+    if (stat(disk_dir, &st) == -1) {
+        mkdir(disk_dir, 0700);
     }
 
-    // load allocation into memory if not already present in memory.
-    pm_load_alloc(ptr);
+    // reattach the allocations of a persistent heap saved in this directory, which keeps its swap file.
+    // Otherwise any saved metadata is stale once the swap file is recreated.
+    snprintf(swap_filename, sizeof(swap_filename), "%s/swap.bin", disk_dir);
+    snprintf(meta_filename, sizeof(meta_filename), "%s/heap.meta", disk_dir);
+    meta_saved = persist && pm_meta_load();
+    if (!meta_saved) {
+        unlink(meta_filename);
+    }
 
-    // increment counter, get char at position.
-    pm_record_lru_counter(ptr);
-    char result = pm_heap[ptr->page_idx * PAGE_SIZE + pos];
-    
-    pm_print_debug(debug_info, ptr);
-    pthread_mutex_unlock(&lock);
-    return result;
-}
+    // create the swap file with every slot preallocated, so page outs never extend it.
+    swap_fd = open(swap_filename, meta_saved ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (swap_fd < 0 || (posix_fallocate(swap_fd, 0, (off_t) total_allocs * page_size) != 0
+            && ftruncate(swap_fd, (off_t) total_allocs * page_size) != 0)) {
+        printf("Error pm_init_config(): couldn't create swap file %s.\n", swap_filename);
+        if (swap_fd >= 0) {
+            close(swap_fd);
+            swap_fd = -1;
+        }
+        for (unsigned int s = 0; s < shard_count; s++) {
+            pthread_mutex_destroy(&shards[s].lock);
+            pthread_rwlock_destroy(&shards[s].obj_lock);
+            pthread_cond_destroy(&shards[s].flush_done);
+        }
+        for (unsigned int c = 0; c < shard_count * OBJ_CLASSES; c++) {
+            pthread_mutex_destroy(&slab_classes[c].lock);
+        }
+        munmap(pm_heap, pm_heap_size);
+        pm_heap = NULL;
+        pthread_mutex_unlock(&init_lock);
+        return false;
+    }
 
-void pm_put(page_t* ptr, int pos, char val, debug_t* debug_info) {
-    pthread_mutex_lock(&lock);
+    // map the swap file if asked. Slots are used in no particular order, so readahead would only waste I/O.
+    swap_map = NULL;
+    swap_drop = page_size % sysconf(_SC_PAGESIZE) == 0;
+    if (geometry.swap_mmap) {
+        char* map = mmap(NULL, total_allocs * page_size, PROT_READ | PROT_WRITE, MAP_SHARED, swap_fd, 0);
+        if (map == MAP_FAILED) {
+            printf("Error pm_init_config(): couldn't map swap file %s, using pread / pwrite.\n", swap_filename);
+        } else {
+            madvise(map, total_allocs * page_size, MADV_RANDOM);
+            swap_map = map;
+        }
+    }
 
-    // check for an invalid page_t ptr.
-    if (pm_invalid_alloc(ptr)) {
-        printf("Error pm_put(): page_t* arg does not point to a valid address.\n");
-        pthread_mutex_unlock(&lock);
-        return;
+    // async workers are only started by the first fault.
+    async_stop = false;
+
+    // count statistics from zero, including in threads that counted for a previous heap.
+    pthread_mutex_lock(&stats_lock);
+    memset(&stats_retired, 0, sizeof(stats_retired));
+    for (pm_thread_stats_t* stats = stats_threads; stats; stats = stats->next) {
+        memset(&stats->counters, 0, sizeof(stats->counters));
     }
+    pthread_mutex_unlock(&stats_lock);
 
-    // check for invalid position.
-    if (pos < 0 || pos >= PAGE_SIZE) {
-        printf("Error pm_put(): pos arg is invalid (%d).\n", pos);
-        pthread_mutex_unlock(&lock);
-        return;
+    // trace from an empty ring. Threads keep a ring of another size until they exit.
+    pthread_mutex_lock(&trace_lock);
+    trace_size = 1;
+    while (trace_size < (geometry.trace_events ? geometry.trace_events : TRACE_EVENTS)) {
+        trace_size *= 2;
     }
+    trace_epoch = pm_now_ns();
+    for (pm_trace_ring_t* ring = trace_rings; ring; ring = ring->next) {
+        __atomic_store_n(&ring->head, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&trace_lock);
 
-    // load allocation into memory if not already present in memory.
-    pm_load_alloc(ptr);
+    // start writing back dirty pages in the background.
+    flusher_stop = false;
+    flusher_kicked = false;
+    flusher_running = geometry.flusher && pthread_create(&flusher_thread, NULL, pm_flusher, NULL) == 0;
+    if (geometry.flusher && !flusher_running) {
+        printf("Error pm_init_config(): couldn't start flusher, evictions will write back dirty pages.\n");
+    }
 
-    // increment lru counter, update char at pos, set dirty.
-    pm_record_lru_counter(ptr);
-    pm_heap[ptr->page_idx * PAGE_SIZE + pos] = val;
-    ptr->dirty = true;
+    pthread_mutex_unlock(&init_lock);
+    return true;
+}
 
-    pm_print_debug(debug_info, ptr);
-    pthread_mutex_unlock(&lock);
+void pm_get_stats(pm_stats_t* stats) {
+    pthread_mutex_lock(&stats_lock);
+    *stats = stats_retired;
+    for (pm_thread_stats_t* thread = stats_threads; thread; thread = thread->next) {
+        pm_stats_add(stats, &thread->counters);
+    }
+    pthread_mutex_unlock(&stats_lock);
 }
 
-void pm_init() {
-    pthread_mutex_lock(&lock);
+bool pm_trace_save(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        printf("Error pm_trace_save(): couldn't open %s.\n", path);
+        return false;
+    }
 
-    // create directory for pages on disk.
-    struct stat st = {0};
+    // the number of events is filled in once they are written.
+    pm_trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PM_TRACE_MAGIC, sizeof(header.magic));
+    header.event_size = sizeof(pm_trace_event_t);
+    header.shards = shard_count;
+    header.page_size = page_size;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    pthread_mutex_lock(&trace_lock);
+    for (pm_trace_ring_t* ring = trace_rings; ring && written; ring = ring->next) {
+        pm_trace_event_t* events = malloc(ring->size * sizeof(pm_trace_event_t));
+        if (!events) {
+            written = false;
+            break;
+        }
 
-    if (stat(DISK_DIR, &st) == -1) {
-        mkdir(DISK_DIR, 0700);
+        // copy the ring while its thread may be recording. Event i is in slot i % size, and the thread
+        // writes event head into its slot before publishing it, so once head has moved on to now, the
+        // events before now + 1 - size may have been overwritten during the copy and are dropped.
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long first = head > ring->size ? head - ring->size : 0;
+        for (unsigned long i = first; i < head; i++) {
+            events[i - first] = ring->events[i & (ring->size - 1)];
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        unsigned long now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        unsigned long valid = now + 1 > ring->size ? now + 1 - ring->size : 0;
+        unsigned long skip = valid > first ? (valid < head ? valid : head) - first : 0;
+        unsigned long count = head - first - skip;
+        written = fwrite(events + skip, sizeof(pm_trace_event_t), count, file) == count;
+        header.events += count;
+        free(events);
     }
+    pthread_mutex_unlock(&trace_lock);
 
-    // set initial lru counter value
-    lru_counter = 1;
+    written = written && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    if (fclose(file) != 0 || !written) {
+        printf("Error pm_trace_save(): couldn't write %s.\n", path);
+        return false;
+    }
+    return true;
+}
 
-    pthread_mutex_unlock(&lock);
+void pm_get_config(pm_config_t* config) {
+    config->page_size = page_size;
+    config->heap_pages = heap_pages;
+    config->disk_pages = disk_pages;
+    config->disk_dir = disk_dir;
+    config->shards = shard_count;
+    config->steal = steal_pages;
+    config->flusher = flusher_running;
+    config->flush_watermark = flush_watermark;
+    config->async_workers = async_workers;
+    config->policy = policy_kind;
+    config->zpool_bytes = zpool_bytes;
+    config->persist = persist;
+    config->swap_mmap = swap_map != NULL;
+    config->thread_cache = thread_cache_size;
+    config->trace_events = trace_size;
+    config->dedup = dedup;
+    config->readahead = readahead_pages;
+    config->evict_batch = evict_batch;
 }
 
 void pm_print_heap() {
     // print actual page bytes in the heap.
     printf("  ⓘ heap:        [ ");
-    for (unsigned long i = 0; i < HEAP_PAGES * PAGE_SIZE; i++) {
-        if (i > 0 && i % PAGE_SIZE == 0) {
+    for (unsigned long i = 0; i < heap_pages * page_size; i++) {
+        if (i > 0 && i % page_size == 0) {
             printf("| ");
         }
 
@@ -388,8 +4346,9 @@ void pm_print_heap() {
 
     // print which pages are available / not.
     printf("    avail pages: [ ");
-    for (int i = 0; i < HEAP_PAGES; i++) {
-        printf("%d ", pm_heap[AVAIL_PAGE_OFFSET + i] != '\0');
+    for (unsigned long i = 0; i < heap_pages; i++) {
+        pm_shard_t* shard = pm_page_shard(i);
+        printf("%d ", pm_bitmap_test(&shard->avail_pages, i - shard->page_base));
     }
     printf("]\n");
 }
@@ -397,17 +4356,19 @@ void pm_print_heap() {
 void pm_print_allocations() {
     // print available allocations.
     printf("    avail alloc: [ ");
-    for (int i = 0; i < HEAP_PAGES + DISK_PAGES; i++) {
-        printf("%d ", pm_heap[AVAIL_ALLOC_OFFSET + i] != '\0');
+    for (unsigned long i = 0; i < total_allocs; i++) {
+        pm_shard_t* shard = pm_alloc_shard(i);
+        printf("%d ", pm_bitmap_test(&shard->avail_allocs, i - shard->alloc_base));
     }
     printf("]\n");
 
     // print allocations themselves.
     printf("    allocations: ");
     bool first = true;
-    for (int i = 0; i < HEAP_PAGES + DISK_PAGES; i++) {
-        if (pm_heap[AVAIL_ALLOC_OFFSET + i] != '\0') {
-            page_t* current_page = (page_t*) (&pm_heap[ALLOC_OFFSET + (i * sizeof(page_t))]);
+    for (unsigned long i = 0; i < total_allocs; i++) {
+        pm_shard_t* shard = pm_alloc_shard(i);
+        if (pm_bitmap_test(&shard->avail_allocs, i - shard->alloc_base)) {
+            page_t* current_page = &alloc_region[i];
             
             if (first) {
                 first = false;
@@ -415,8 +4376,8 @@ void pm_print_allocations() {
                 printf(", ");
             }
 
-            printf("{alloc_idx=%d, page_idx=%d, dirty=%d, lru_count=%ld}",
-                current_page->alloc_idx, current_page->page_idx, current_page->dirty, current_page->lru_count);
+            printf("{alloc_idx=%d, page_idx=%d, dirty=%d, lru_prev=%d, lru_next=%d}",
+                current_page->alloc_idx, current_page->page_idx, current_page->dirty, current_page->lru_prev, current_page->lru_next);
         }
     }
     // print None if no allocations yet.
@@ -427,10 +4388,69 @@ void pm_print_allocations() {
 }
 
 void pm_cleanup(bool rm_disk) {
+    pthread_mutex_lock(&init_lock);
+
+    // let the async workers finish the queued faults while the heap is still intact.
+    pthread_mutex_lock(&async_lock);
+    async_stop = true;
+    pthread_cond_broadcast(&async_cond);
+    pthread_mutex_unlock(&async_lock);
+    for (unsigned int w = 0; w < async_started; w++) {
+        pthread_join(async_threads[w], NULL);
+    }
+    free(async_threads);
+    async_threads = NULL;
+    async_started = 0;
+
+    // stop the flusher before the swap file goes away.
+    if (flusher_running) {
+        pthread_mutex_lock(&flusher_lock);
+        flusher_stop = true;
+        pthread_cond_signal(&flusher_cond);
+        pthread_mutex_unlock(&flusher_lock);
+        pthread_join(flusher_thread, NULL);
+        flusher_running = false;
+    }
+
+    // a persistent heap is saved for the next pm_init_config, unless its disk directory is removed.
+    // Otherwise the swap file is only meaningful to this heap.
+    if (swap_fd >= 0) {
+        if (persist && !rm_disk) {
+            pm_checkpoint();
+        } else {
+            unlink(meta_filename);
+            unlink(swap_filename);
+        }
+        if (swap_map) {
+            munmap(swap_map, total_allocs * page_size);
+            swap_map = NULL;
+        }
+        close(swap_fd);
+        swap_fd = -1;
+    }
+
     // option to remove disk directory.
     if (rm_disk) {
-        rmdir(DISK_DIR);
+        rmdir(disk_dir);
     }
-    
-    pthread_mutex_destroy(&lock);
-}
\ No newline at end of file
+
+    // release the shards, the bookkeeping of pm_obj objects and the arena.
+    if (pm_heap) {
+        for (unsigned int s = 0; s < shard_count; s++) {
+            pthread_mutex_destroy(&shards[s].lock);
+            pthread_rwlock_destroy(&shards[s].obj_lock);
+            pthread_cond_destroy(&shards[s].flush_done);
+        }
+        for (unsigned int c = 0; c < shard_count * OBJ_CLASSES; c++) {
+            pthread_mutex_destroy(&slab_classes[c].lock);
+        }
+        for (unsigned long a = 0; a < total_allocs; a++) {
+            free(obj_slabs[a]);
+            free(obj_spans[a]);
+        }
+        munmap(pm_heap, pm_heap_size);
+        pm_heap = NULL;
+    }
+
+    pthread_mutex_unlock(&init_lock);
+}
@@ -10,21 +10,93 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-// size of a page
+// default size of a page
 #define PAGE_SIZE 8
-// available pages in heap
+// default available pages in heap
 #define HEAP_PAGES 2
-// available pages for disk
+// default available pages for disk
 #define DISK_PAGES 1
-// directory name for where pages on disk go
+// default directory name for where pages on disk go
 #define DISK_DIR "disk"
-// offset for where allocation structures start
-#define ALLOC_OFFSET (PAGE_SIZE * HEAP_PAGES)
-// offset for where available pages start
-#define AVAIL_PAGE_OFFSET (ALLOC_OFFSET + ((HEAP_PAGES + DISK_PAGES) * sizeof(page_t)))
-// offset for where available allocations start
-#define AVAIL_ALLOC_OFFSET (AVAIL_PAGE_OFFSET + HEAP_PAGES)
+// default number of events each thread's trace ring keeps
+#define TRACE_EVENTS 4096
+// most pages read ahead at once, by readahead or a pm_prefetch call per shard
+#define READAHEAD_MAX 64
+// most pages evicted at once by a shard that has no open page
+#define EVICT_BATCH_MAX 64
+
+// page replacement policies, which choose the page in memory to evict when a shard needs room.
+enum pm_policy {
+    // evict the least recently used page.
+    PM_POLICY_LRU,
+    // evict pages in the order they came into memory, except that a page accessed since the clock hand
+    // last passed it gets a second chance. Accesses only set a flag, so they never reorder a list.
+    PM_POLICY_CLOCK,
+    // new pages go through a FIFO queue, and only pages brought back soon after being evicted from it
+    // are kept in LRU order. A scan only ever displaces the FIFO.
+    PM_POLICY_2Q,
+    // adaptive replacement cache: splits memory between pages used once and pages used more than once,
+    // and adapts the split from the history of recent evictions.
+    PM_POLICY_ARC
+};
+typedef enum pm_policy pm_policy_t;
+
+// geometry of the heap, chosen at runtime. A page_size / heap_pages of 0 or a NULL disk_dir uses the defaults above.
+struct pm_config {
+    // size of a page in bytes.
+    unsigned long page_size;
+    // number of pages that can be resident in memory.
+    unsigned long heap_pages;
+    // number of additional pages that can be swapped out to disk.
+    unsigned long disk_pages;
+    // directory where the swap file goes.
+    const char* disk_dir;
+    // number of independently locked shards the pages and allocations are split into. 0 means 1.
+    // Capped at heap_pages so every shard has a page in memory.
+    unsigned int shards;
+    // if true, a shard that runs out of pages in memory borrows an open page from another shard
+    // before evicting one of its own.
+    bool steal;
+    // if true, a background thread writes back dirty pages near the cold end of each shard's lists in memory,
+    // so evictions can drop clean pages instead of writing to disk under the shard's lock.
+    bool flusher;
+    // number of pages at the cold end of each list in memory the flusher keeps clean. 0 means an
+    // eighth of the shard's pages in memory.
+    unsigned long flush_watermark;
+    // number of worker threads that fault pages in for pm_access_async. 0 means 4.
+    unsigned int async_workers;
+    // replacement policy of every shard. 0 means PM_POLICY_LRU.
+    pm_policy_t policy;
+    // bytes of memory for a pool that holds evicted dirty pages compressed, split evenly over the shards.
+    // Pages only go to disk once the pool overflows. 0 disables the pool.
+    unsigned long zpool_bytes;
+    // if true, the allocations survive pm_cleanup(false): the allocation table and swap slots are saved in
+    // disk_dir next to the swap file, and the next heap with the same geometry and disk_dir reattaches them
+    // instead of starting empty. Allocations are brought back into memory as they are accessed.
+    bool persist;
+    // if true, the swap file is mapped into memory and pages are copied in and out of the mapping instead
+    // of read and written with pread / pwrite, leaving reads and write back to the kernel's page cache.
+    bool swap_mmap;
+    // number of allocations each thread reserves from its shard at a time, so most pm_malloc and pm_free calls
+    // don't take the shard's lock. Frees are also finished in batches of this size. 0 disables the caches.
+    unsigned int thread_cache;
+    // number of events each thread's trace ring keeps, rounded up to a power of two. 0 means TRACE_EVENTS.
+    unsigned long trace_events;
+    // if true, an evicted dirty page identical to a page already in one of its shard's swap slots shares
+    // that slot instead of being written. Pages are matched by a 64-bit hash of their contents, confirmed
+    // by comparing the bytes.
+    bool dedup;
+    // number of pages read ahead of a thread's accesses once its faults follow a constant stride through the
+    // allocations (e.g. one after another), up to READAHEAD_MAX. 0 disables readahead.
+    unsigned int readahead;
+    // most pages a shard evicts at once when it has no open page, up to EVICT_BATCH_MAX and half of its pages in
+    // memory. The dirty ones are written together, and the pages not needed right away are left open. 0 or 1
+    // evicts a page at a time.
+    unsigned int evict_batch;
+};
+typedef struct pm_config pm_config_t;
 
 // represents an allocated page
 struct pm_allocation {
@@ -34,11 +106,138 @@ struct pm_allocation {
     int page_idx;
     // if true, page modified since last written to disk.
     bool dirty;
-    // counter to track recently used pages.
-    unsigned long lru_count;
+    // previous (more recently added) allocation in the replacement policy's list, or -1.
+    int lru_prev;
+    // next (less recently added) allocation in the replacement policy's list, or -1.
+    int lru_next;
+    // replacement policy list the allocation is in, or -1. Allocations on disk can be on a list of
+    // recently evicted allocations.
+    int lru_list;
+    // slot in the swap file holding the page on disk. If < 0, page was never written to disk, or held only '\0'
+    // when it was last evicted, and holds only '\0' unless it is in memory or the compressed pool. With
+    // pm_config_t.dedup, identical pages can share a slot.
+    int swap_slot;
+    // number of outstanding pm_pin calls. If > 0, page stays in memory and is not in a policy list.
+    unsigned int pin_count;
+    // if true, page was read without the lock since it was last moved in its policy list.
+    bool referenced;
+    // if true, allocation is held in a thread's cache (see pm_config_t.thread_cache) and is not in use.
+    bool cached;
+    // if true, page was brought into memory by readahead or pm_prefetch and hasn't been accessed since.
+    bool prefetched;
 };
 typedef struct pm_allocation page_t;
 
+// runtime statistics, counted since pm_init_config. Every field is a count unless its name says otherwise.
+struct pm_stats {
+    // byte accesses and range reads or writes of an allocation, including pins and async reads.
+    unsigned long accesses;
+    // accesses that found the page in memory.
+    unsigned long hits;
+    // pages brought into memory from the compressed pool or disk.
+    unsigned long faults;
+    // faults served from the compressed pool.
+    unsigned long pool_hits;
+    // pages evicted from memory to make room, split into the clean and dirty ones.
+    unsigned long evictions;
+    unsigned long clean_evictions;
+    unsigned long dirty_evictions;
+    // dirty pages written back by the flusher.
+    unsigned long flusher_writes;
+    // evicted dirty pages stored in the compressed pool, and pages the pool wrote to disk when it overflowed.
+    unsigned long pool_stores;
+    unsigned long pool_write_backs;
+    // page reads and writes of the swap file, and the bytes they moved.
+    unsigned long disk_reads;
+    unsigned long disk_writes;
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    // calls that wrote to the swap file, counting a pwritev of several pages as one.
+    unsigned long write_calls;
+    // bytes of dirty pages that weren't written because only some of their blocks had changed.
+    unsigned long bytes_skipped;
+    // reads of allocations holding only '\0' served without bringing them into memory, and evicted dirty
+    // pages holding only '\0' that were dropped instead of stored.
+    unsigned long zero_reads;
+    unsigned long zero_evictions;
+    // evicted dirty pages that shared the swap slot of an identical page instead of being written, and
+    // pages given a slot of their own because they changed while sharing one (see pm_config_t.dedup).
+    unsigned long dedup_hits;
+    unsigned long dedup_copies;
+    // pages brought into memory by readahead or pm_prefetch, and those that were then accessed before
+    // being evicted.
+    unsigned long readahead_pages;
+    unsigned long readahead_hits;
+    // pages evicted along with a page a shard needed, to batch their writes (see pm_config_t.evict_batch).
+    unsigned long batch_evictions;
+    // pm_malloc calls that failed because no allocation was left.
+    unsigned long alloc_failures;
+    // nanoseconds spent waiting for shard locks held by other threads.
+    unsigned long lock_wait_ns;
+    // nanoseconds spent in swap file reads and writes.
+    unsigned long io_ns;
+};
+typedef struct pm_stats pm_stats_t;
+
+// operations recorded by the tracer (see pm_trace_save).
+enum pm_trace_type {
+    // pm_malloc, pm_malloc_batch (an event per allocation) and pm_free, pm_free_batch.
+    PM_TRACE_MALLOC,
+    PM_TRACE_FREE,
+    // reads (pm_access, pm_read, pm_access_async, pm_pin) and writes (pm_put, pm_write, pm_memset).
+    PM_TRACE_ACCESS,
+    PM_TRACE_PUT,
+    // a page brought into memory, including pages read ahead, and a page evicted from memory.
+    PM_TRACE_FAULT,
+    PM_TRACE_EVICT,
+    // a wait for a shard's lock held by another thread.
+    PM_TRACE_LOCK_WAIT,
+    PM_TRACE_TYPES
+};
+typedef enum pm_trace_type pm_trace_type_t;
+
+// flags of a trace event: a read served without the lock, a fault served from the compressed pool, an
+// evicted page that was dirty, a page read ahead of its access.
+#define PM_TRACE_LOCKLESS 1
+#define PM_TRACE_POOL 2
+#define PM_TRACE_DIRTY 4
+#define PM_TRACE_READAHEAD 8
+
+// a traced operation, as saved by pm_trace_save.
+struct pm_trace_event {
+    // when the operation started, in nanoseconds since pm_init_config, and how long it took.
+    uint64_t time_ns;
+    uint32_t duration_ns;
+    // the allocation, or -1 for lock waits and failed pm_malloc calls.
+    int32_t alloc_idx;
+    // the offset of a read or write, the page in memory of a malloc, fault or evict, or the shard of a lock wait.
+    int32_t arg;
+    // the thread that recorded the event, numbered in the order threads first recorded one.
+    uint16_t thread;
+    // a pm_trace_type_t, and PM_TRACE_* flags.
+    uint8_t type;
+    uint8_t flags;
+};
+typedef struct pm_trace_event pm_trace_event_t;
+
+// start of a file saved by pm_trace_save, followed by its events.
+#define PM_TRACE_MAGIC "PMTRACE1"
+struct pm_trace_header {
+    char magic[8];
+    // sizeof(pm_trace_event_t), so a reader can tell the file's format apart.
+    uint32_t event_size;
+    // number of shards of the heap that recorded the events.
+    uint32_t shards;
+    uint64_t page_size;
+    // number of events in the file.
+    uint64_t events;
+};
+typedef struct pm_trace_header pm_trace_header_t;
+
+// handle of an object allocated with pm_obj_malloc. It encodes the allocation holding the object (plus one),
+// the object's size class and its slot in the allocation's page. 0 is never a valid handle.
+typedef uint64_t pm_obj_t;
+
 // debug information
 struct pm_debug {
     char completionMsg[64];
@@ -46,7 +245,8 @@ struct pm_debug {
 typedef struct pm_debug debug_t;
 
 /**
- * Try to allocate the requested number of bytes.
+ * Try to allocate the requested number of bytes. The allocation holds '\0' and isn't given a page in memory
+ * until it is first written, so allocating never evicts a page, and reading it before then costs no fault.
  *
  * @param bytes the number of bytes to allocate.
  * @param debug_info the debug info to print with successful allocation, or NULL.
@@ -54,6 +254,17 @@ typedef struct pm_debug debug_t;
 */
 page_t* pm_malloc(unsigned long bytes, debug_t* debug_info);
 
+/**
+ * Allocate a batch of pages, taking each shard's lock once. Like pm_malloc, the allocations get pages in
+ * memory when they are first written.
+ *
+ * @param n the number of allocations.
+ * @param sizes the number of bytes of each allocation.
+ * @param out where to store the pointers, or NULL for those that couldn't be allocated.
+ * @return the number of allocations made, which are the first ones of out. 0 if any size is invalid.
+ */
+unsigned long pm_malloc_batch(unsigned long n, const unsigned long* sizes, page_t** out);
+
 /**
  * Reclaim memory used by a pointer called from pm_malloc.
  * 
@@ -62,6 +273,58 @@ page_t* pm_malloc(unsigned long bytes, debug_t* debug_info);
 */
 void pm_free(page_t* ptr, debug_t* debug_info);
 
+/**
+ * Reclaim a batch of pointers, taking each shard's lock once. Invalid or pinned pointers are skipped.
+ *
+ * @param n the number of pointers.
+ * @param ptrs the pointers to free.
+ * @return the number of pointers freed.
+ */
+unsigned long pm_free_batch(unsigned long n, page_t** ptrs);
+
+/**
+ * Allocate an object of any size. Objects of up to half a page share the pages of their size class (powers of
+ * two from 16 B), each page holding as many objects of the class as fit, so small objects don't take a page
+ * each. Larger objects take as many whole pages as they need. An object holds '\0' when it is allocated. A
+ * page's free slots are tracked outside of it, so freeing never brings the page into memory, and allocating
+ * only does to clear a slot that held an object before. Objects aren't reattached by a persistent heap.
+ *
+ * @param bytes the number of bytes to allocate.
+ * @return a handle to the object, or 0 if bytes is 0 or there isn't enough space.
+ */
+pm_obj_t pm_obj_malloc(unsigned long bytes);
+
+/**
+ * Reclaim an object allocated with pm_obj_malloc. A page of a size class is freed once its last object is,
+ * unless it is the only page of its class with a free slot.
+ *
+ * @param obj the object to free.
+ */
+void pm_obj_free(pm_obj_t obj);
+
+/**
+ * Copy a range of bytes out of an object, with pm_read on each page the range covers.
+ *
+ * @param obj the object to read from.
+ * @param off the position of the first byte to read.
+ * @param dst where to copy the bytes to.
+ * @param len the number of bytes to read. off + len must not exceed the object's size class, or for an
+ *     object of more than half a page, the size it was allocated with.
+ * @return true if the bytes were read, false if obj isn't allocated or the range is invalid.
+ */
+bool pm_obj_read(pm_obj_t obj, unsigned long off, void* dst, unsigned long len);
+
+/**
+ * Copy a range of bytes into an object, with pm_write on each page the range covers.
+ *
+ * @param obj the object to write to.
+ * @param off the position of the first byte to write.
+ * @param src where to copy the bytes from.
+ * @param len the number of bytes to write, within the object as for pm_obj_read.
+ * @return true if the bytes were written, false if obj isn't allocated or the range is invalid.
+ */
+bool pm_obj_write(pm_obj_t obj, unsigned long off, const void* src, unsigned long len);
+
 /**
  * Read the byte at position for the given ptr.
  *
@@ -83,11 +346,164 @@ char pm_access(page_t* ptr, int pos, debug_t* debug_info);
 void pm_put(page_t* ptr, int pos, char val, debug_t* debug_info);
 
 /**
- * Initialization. Call before any other function in pm_heap.
+ * Copy a range of bytes out of the given ptr. The pointer is validated, the page faulted in and the
+ * lock taken once for the whole range.
+ *
+ * @param ptr the pointer to read from.
+ * @param off the position of the first byte to read.
+ * @param dst where to copy the bytes to.
+ * @param len the number of bytes to read. off + len must not exceed the page size.
+ * @param debug_info the debug info to print with, or NULL.
+ * @return true if the bytes were read, false if ptr or the range is invalid.
+ */
+bool pm_read(page_t* ptr, unsigned long off, void* dst, unsigned long len, debug_t* debug_info);
+
+/**
+ * Copy a range of bytes into the given ptr. The pointer is validated, the page faulted in and the
+ * lock taken once for the whole range.
+ *
+ * @param ptr the pointer to write to.
+ * @param off the position of the first byte to write.
+ * @param src where to copy the bytes from.
+ * @param len the number of bytes to write. off + len must not exceed the page size.
+ * @param debug_info the debug info to print with, or NULL.
+ * @return true if the bytes were written, false if ptr or the range is invalid.
+ */
+bool pm_write(page_t* ptr, unsigned long off, const void* src, unsigned long len, debug_t* debug_info);
+
+/**
+ * Set a range of bytes of the given ptr to a value.
+ *
+ * @param ptr the pointer to set.
+ * @param off the position of the first byte to set.
+ * @param val the value to set.
+ * @param len the number of bytes to set. off + len must not exceed the page size.
+ * @param debug_info the debug info to print with, or NULL.
+ * @return true if the bytes were set, false if ptr or the range is invalid.
+ */
+bool pm_memset(page_t* ptr, unsigned long off, char val, unsigned long len, debug_t* debug_info);
+
+/**
+ * Pin the page for the given ptr in memory and get a direct pointer to its bytes. The page can't be
+ * evicted or freed until every pin is released with pm_unpin, so the bytes can be used without the lock.
+ * Callers must coordinate concurrent access to a pinned page themselves.
+ *
+ * @param ptr the pointer to pin.
+ * @param writable true if the caller will write through the returned pointer, which marks the page dirty.
+ * @return the page's bytes in memory (valid for page size bytes until pm_unpin), or NULL if ptr is invalid
+ *     or every page in memory is already pinned.
+ */
+char* pm_pin(page_t* ptr, bool writable);
+
+/**
+ * Release a pin taken with pm_pin. The pointer returned by pm_pin must not be used afterwards.
+ *
+ * @param ptr the pointer to unpin.
+ */
+void pm_unpin(page_t* ptr);
+
+/**
+ * Hint that allocations will be accessed soon. Those on disk or in the compressed pool are brought into
+ * free pages in memory or pages holding clean allocations, without writing anything back, and allocations in
+ * consecutive swap slots are read with a single preadv. Stops early in a shard once it has no such page left.
+ *
+ * @param n the number of pointers.
+ * @param ptrs the pointers to bring into memory. Invalid pointers are skipped.
+ * @return the number of allocations brought into memory.
+ */
+unsigned long pm_prefetch(unsigned long n, page_t** ptrs);
+
+/**
+ * Callback for pm_access_async, invoked once the requested bytes have been read.
+ *
+ * @param ptr the pointer that was read.
+ * @param data a copy of the requested bytes, valid until the callback returns, or NULL if the page
+ *     couldn't be brought into memory or ptr was freed meanwhile.
+ * @param len the number of bytes requested.
+ * @param ctx the context passed to pm_access_async.
+ */
+typedef void (*pm_access_cb_t)(page_t* ptr, const char* data, unsigned long len, void* ctx);
+
+/**
+ * Read a range of bytes from the given ptr without blocking on disk I/O. If the page is in memory,
+ * cb is invoked before this returns. Otherwise the page is faulted in by a worker thread, which then
+ * invokes cb, so any number of faults can be outstanding at once.
+ *
+ * @param ptr the pointer to read from.
+ * @param off the position of the first byte to read.
+ * @param len the number of bytes to read. off + len must not exceed the page size.
+ * @param cb the callback to invoke with the bytes.
+ * @param ctx passed to cb as is.
+ * @return true if cb was or will be invoked, false if ptr or the range is invalid.
+ */
+bool pm_access_async(page_t* ptr, unsigned long off, unsigned long len, pm_access_cb_t cb, void* ctx);
+
+/**
+ * Give back the allocations the calling thread holds in its cache, and finish the frees waiting in it.
+ * Happens on its own when the thread exits. Does nothing if the heap has no thread caches.
+ */
+void pm_thread_cache_flush();
+
+/**
+ * Save every allocation of a persistent heap to disk, so a restart after a crash reattaches them as they
+ * are now. Dirty pages and the compressed pool are written to the swap file, which is synced before the
+ * checksummed allocation table replaces the previous one with an atomic rename. The first write to the swap
+ * file after this removes the saved table again, so a crash before the next checkpoint starts empty rather
+ * than reattaching pages that were partly overwritten.
+ *
+ * @return true if the heap was saved, false if it isn't persistent or couldn't be written.
+ */
+bool pm_checkpoint();
+
+/**
+ * Get the pointer of an allocation by its alloc_idx, e.g. to find allocations reattached by a persistent heap.
+ *
+ * @param alloc_idx the allocation's index.
+ * @return the pointer, or NULL if the allocation isn't in use.
+ */
+page_t* pm_attach(unsigned int alloc_idx);
+
+/**
+ * Initialization with the default geometry. Call before any other function in pm_heap.
  * 
 */
 void pm_init();
 
+/**
+ * Initialization with a runtime geometry. Call before any other function in pm_heap.
+ * The pages, allocation structures and availability maps are carved out of a single
+ * page-aligned arena sized from config.
+ *
+ * @param config the geometry to use, or NULL for the defaults.
+ * @return true if the heap was initialized, false if config is invalid or the arena couldn't be allocated.
+ */
+bool pm_init_config(const pm_config_t* config);
+
+/**
+ * Get the geometry the heap was initialized with.
+ *
+ * @param config where to write the geometry.
+ */
+void pm_get_config(pm_config_t* config);
+
+/**
+ * Get the statistics counted since the heap was initialized, summed over every thread. Counting is
+ * per thread and never takes a lock, so the totals may miss a few events still in progress.
+ *
+ * @param stats where to write the statistics.
+ */
+void pm_get_stats(pm_stats_t* stats);
+
+/**
+ * Save the events every thread's trace ring holds to a binary file, for pm_trace_dump to decode. Each thread
+ * records its operations into its own ring without taking a lock, keeping the latest pm_config_t.trace_events,
+ * and the rings are read while they are being written, so an event overwritten during the save is left out.
+ *
+ * @param path the file to write.
+ * @return true if the file was written.
+ */
+bool pm_trace_save(const char* path);
+
 /**
  * Print the current state of heap pages and available pages. Can be used for debugging.
 */
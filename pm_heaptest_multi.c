@@ -69,10 +69,14 @@ void* pm_exercise_thread(void *data) {
 
 
 int main() {
-    pm_init();
+    // split the heap into one shard per page in memory, borrowing pages between shards when one runs out.
+    pm_config_t config = { .shards = HEAP_PAGES, .steal = true, .disk_pages = DISK_PAGES };
+    pm_init_config(&config);
+    pm_get_config(&config);
 
     // print initial state of heap
-    printf("-- pm_heap state: %d heap pages and %d disk pages. Page size = %d B --\n", HEAP_PAGES, DISK_PAGES, PAGE_SIZE);
+    printf("-- pm_heap state: %lu heap pages and %lu disk pages in %u shards. Page size = %lu B --\n",
+        config.heap_pages, config.disk_pages, config.shards, config.page_size);
     pm_print_heap();
     pm_print_allocations();
     printf("Starting...\n---------------------------------------------------\n");
@@ -0,0 +1,168 @@
+/*
+*  pm_heaptest_policy.c / Assignment: Practicum 1
+*
+*  James Florez and John Ciolfi / CS5600 / Northeastern University
+*  Spring 2023 / Mar 17, 2023
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "pm_heap.h"
+
+// pages in memory for every policy test. Allocations past this many evict.
+#define POLICY_HEAP_PAGES 4
+// most allocations a policy test makes.
+#define POLICY_ALLOCS 12
+
+// allocations of the current test, and whether each was in memory after the last step.
+page_t* allocs[POLICY_ALLOCS];
+const char* names[POLICY_ALLOCS];
+int in_memory[POLICY_ALLOCS];
+int alloc_count;
+
+// allocations evicted since the test started, in order.
+char evicted[256];
+
+/**
+ * Record the allocations that left memory since the last step.
+ */
+void record_evictions() {
+    for (int i = 0; i < alloc_count; i++) {
+        int now = allocs[i]->page_idx >= 0;
+        if (in_memory[i] && !now) {
+            strcat(evicted, evicted[0] ? " " : "");
+            strcat(evicted, names[i]);
+        }
+        in_memory[i] = now;
+    }
+}
+
+/**
+ * Allocate a page for the current test and write it, which brings it into memory.
+ *
+ * @param name the name of the allocation, printed in the eviction order.
+ * @return the allocation.
+ */
+page_t* alloc(const char* name) {
+    allocs[alloc_count] = pm_malloc(PAGE_SIZE, NULL);
+    names[alloc_count] = name;
+    pm_put(allocs[alloc_count], 0, 'x', NULL);
+    in_memory[alloc_count] = 1;
+    alloc_count++;
+    record_evictions();
+    return allocs[alloc_count - 1];
+}
+
+/**
+ * Access a page with the lock held, bringing it into memory if it is on disk.
+ *
+ * @param ptr the allocation to access.
+ */
+void use(page_t* ptr) {
+    pm_put(ptr, 0, 'x', NULL);
+    record_evictions();
+}
+
+/**
+ * Start a test with an empty heap using the given policy.
+ *
+ * @param policy the replacement policy.
+ */
+void start(pm_policy_t policy) {
+    pm_config_t config = { .heap_pages = POLICY_HEAP_PAGES, .disk_pages = POLICY_ALLOCS, .policy = policy };
+    pm_init_config(&config);
+    alloc_count = 0;
+    evicted[0] = '\0';
+}
+
+/**
+ * Print the eviction order of the test and compare it with the expected one.
+ *
+ * @param name the name of the test.
+ * @param expected the expected eviction order.
+ * @return 1 if the order is different, 0 otherwise.
+ */
+int finish(const char* name, const char* expected) {
+    bool passed = strcmp(evicted, expected) == 0;
+    printf("%s %-8s evicted: %-30s expected: %s\n", passed ? "✔" : "✗", name, evicted, expected);
+    pm_cleanup(false);
+    return passed ? 0 : 1;
+}
+
+/**
+ * Recency: fill memory with a0-a3, use a1 then a0, then allocate a4-a6.
+ *
+ * @param policy the replacement policy.
+ */
+void test_recency(pm_policy_t policy) {
+    start(policy);
+    page_t* a0 = alloc("a0");
+    page_t* a1 = alloc("a1");
+    alloc("a2");
+    alloc("a3");
+    use(a1);
+    use(a0);
+    alloc("a4");
+    alloc("a5");
+    alloc("a6");
+}
+
+/**
+ * Scan: use a hot set h0-h1, scan s0-s3, use the hot set again and scan s4-s9.
+ *
+ * @param policy the replacement policy.
+ */
+void test_scan(pm_policy_t policy) {
+    start(policy);
+    page_t* h0 = alloc("h0");
+    page_t* h1 = alloc("h1");
+    use(h0);
+    use(h1);
+    alloc("s0");
+    alloc("s1");
+    alloc("s2");
+    alloc("s3");
+    use(h0);
+    use(h1);
+    alloc("s4");
+    alloc("s5");
+    alloc("s6");
+    alloc("s7");
+    alloc("s8");
+    alloc("s9");
+}
+
+int main() {
+    int failed = 0;
+
+    // LRU evicts the least recently used page, so the scan flushes the hot set.
+    puts("------------------------------ LRU ------------------------------");
+    test_recency(PM_POLICY_LRU);
+    failed += finish("recency", "a2 a3 a1");
+    test_scan(PM_POLICY_LRU);
+    failed += finish("scan", "h0 h1 s0 s1 s2 s3 h0 h1 s4 s5");
+
+    // CLOCK only gives used pages a second chance, in the order it comes across them.
+    puts("\n----------------------------- CLOCK -----------------------------");
+    test_recency(PM_POLICY_CLOCK);
+    failed += finish("recency", "a2 a3 a0");
+    test_scan(PM_POLICY_CLOCK);
+    failed += finish("scan", "s0 s1 s2 s3 h0 h1 s4 s5");
+
+    // 2Q evicts new pages in FIFO order, and keeps pages that come back soon after eviction.
+    puts("\n------------------------------ 2Q ------------------------------");
+    test_recency(PM_POLICY_2Q);
+    failed += finish("recency", "a0 a1 a2");
+    test_scan(PM_POLICY_2Q);
+    failed += finish("scan", "h0 h1 s0 s1 s2 s3 s4 s5 s6 s7");
+
+    // ARC keeps pages used twice on the frequency list, away from the scan.
+    puts("\n------------------------------ ARC ------------------------------");
+    test_recency(PM_POLICY_ARC);
+    failed += finish("recency", "a2 a3 a4");
+    test_scan(PM_POLICY_ARC);
+    failed += finish("scan", "s0 s1 s2 s3 s4 s5 s6 s7");
+
+    printf("\n%d policy test(s) failed\n", failed);
+    return failed != 0;
+}
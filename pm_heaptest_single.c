@@ -8,8 +8,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "pm_heap.h"
 
+// print the bytes read by pm_access_async, and flag the caller's int as done.
+void print_async(page_t* ptr, const char* data, unsigned long len, void* ctx) {
+    (void) ptr;
+    printf("Value read async = %.*s\n", (int) len, data ? data : "");
+    if (ctx) {
+        __atomic_store_n((int*) ctx, 1, __ATOMIC_RELEASE);
+    }
+}
+
 int main() {
     pm_init();
 
@@ -93,13 +103,15 @@ int main() {
     puts("\n✔ pm_put c0");
     pm_put(c0, 0, 'A', &c0Details);
 
-    // c1 should be evicted and saved to disk to make room for c2.
-    puts("\n✔ pm_malloc c2 - evicts c1");
+    // c2 has no page in memory until it is written, so c1 is only evicted and saved to disk then.
+    puts("\n✔ pm_malloc c2");
     debug_t c2Details = { "c2" };
     page_t* c2 = pm_malloc(PAGE_SIZE, &c2Details);
     if (c2 == NULL) {
         puts("Couldn't allocate c2");
     }
+    puts("\n✔ pm_put c2 - evicts c1");
+    pm_put(c2, 2, 'C', &c2Details);
 
     puts("\n✗ pm_malloc with no more pages left");
     if (pm_malloc(PAGE_SIZE, NULL) == NULL) {
@@ -149,7 +161,464 @@ int main() {
     puts("\n✔ pm_free c4 - in memory");
     pm_free(c4, &c4Details);
 
+    puts("\n------------------- Testing bulk read / write -------------------");
+
+    debug_t d0Details = { "d0" };
+    debug_t d1Details = { "d1" };
+    debug_t d2Details = { "d2" };
+    page_t* d0 = pm_malloc(PAGE_SIZE, &d0Details);
+    page_t* d1 = pm_malloc(PAGE_SIZE, &d1Details);
+    char buf[PAGE_SIZE];
+
+    // Test bulk functions with invalid inputs.
+    puts("\n✗ pm_write with range past end of page");
+    pm_write(d0, 1, "pm_heap", PAGE_SIZE, &d0Details);
+    puts("\n✗ pm_read with offset past end of page");
+    pm_read(d0, PAGE_SIZE + 1, buf, 0, &d0Details);
+    puts("\n✗ pm_memset with length larger than a page");
+    pm_memset(d0, 0, 'A', PAGE_SIZE + 1, &d0Details);
+    puts("\n✗ pm_read with valid page struct address but not yet allocated");
+    pm_read(d1 + 1, 0, buf, PAGE_SIZE, &d1Details);
+
+    // write a whole page at once and read it back.
+    puts("\n✔ pm_write d0 - whole page");
+    pm_write(d0, 0, "pm_heap", PAGE_SIZE, &d0Details);
+    puts("\n✔ pm_read d0 - whole page");
+    pm_read(d0, 0, buf, PAGE_SIZE, &d0Details);
+    printf("Value of d0 = %s\n", buf);
+
+    // set a range in d1 and read it back with pm_access.
+    puts("\n✔ pm_memset d1 - positions 2 to 5");
+    pm_memset(d1, 2, 'D', 4, &d1Details);
+    printf("Value of d1 at position 1 = %d, position 2 = %c, position 5 = %c, position 6 = %d\n",
+        pm_access(d1, 1, NULL), pm_access(d1, 2, NULL), pm_access(d1, 5, NULL), pm_access(d1, 6, NULL));
+
+    // d0 is the LRU page, so it is evicted and saved to disk to make room for d2.
+    puts("\n✔ pm_malloc d2, pm_put d2 - evicts d0");
+    page_t* d2 = pm_malloc(PAGE_SIZE, &d2Details);
+    pm_put(d2, 0, 'D', &d2Details);
+
+    // read part of d0, bringing it back into memory from disk.
+    puts("\n✔ pm_read d0 - positions 3 to 7 after getting evicted");
+    memset(buf, '\0', PAGE_SIZE);
+    pm_read(d0, 3, buf, PAGE_SIZE - 3, &d0Details);
+    printf("Value of d0 from position 3 = %s\n", buf);
+
+    puts("\n✔ pm_free d0, d1, d2");
+    pm_free(d0, NULL);
+    pm_free(d1, NULL);
+    pm_free(d2, NULL);
+
+    puts("\n----------------------- Testing pin / unpin -----------------------");
+
+    debug_t e0Details = { "e0" };
+    debug_t e1Details = { "e1" };
+    debug_t e2Details = { "e2" };
+    page_t* e0 = pm_malloc(PAGE_SIZE, &e0Details);
+
+    // write through the pinned pointer without going through the heap.
+    puts("\n✔ pm_pin e0 - writable");
+    char* e0Bytes = pm_pin(e0, true);
+    strcpy(e0Bytes, "pinned");
+
+    // e0 is older than e1, but pinned, so e1 is evicted to make room for e2.
+    puts("\n✔ pm_malloc e1, e2, pm_put e2 - evicts e1 since e0 is pinned");
+    page_t* e1 = pm_malloc(PAGE_SIZE, &e1Details);
+    pm_put(e1, 0, 'E', &e1Details);
+    page_t* e2 = pm_malloc(PAGE_SIZE, &e2Details);
+    pm_put(e2, 0, 'E', &e2Details);
+
+    puts("\n✗ pm_free e0 while pinned");
+    pm_free(e0, &e0Details);
+
+    // with every page in memory pinned, e1 can't be brought back into memory.
+    puts("\n✗ pm_access e1 while every page in memory is pinned");
+    pm_pin(e2, false);
+    pm_access(e1, 0, &e1Details);
+
+    puts("\n✔ pm_unpin e0, e2");
+    pm_unpin(e0);
+    pm_unpin(e2);
+
+    puts("\n✗ pm_unpin e2 when not pinned");
+    pm_unpin(e2);
+
+    puts("\n✔ pm_access e1 - evicts e0 after unpinning");
+    printf("Value of e1 at position 0 = %c\n", pm_access(e1, 0, &e1Details));
+
+    puts("\n✔ pm_read e0 - written through pinned pointer");
+    pm_read(e0, 0, buf, PAGE_SIZE, &e0Details);
+    printf("Value of e0 = %s\n", buf);
+
+    puts("\n✔ pm_free e0, e1, e2");
+    pm_free(e0, NULL);
+    pm_free(e1, NULL);
+    pm_free(e2, NULL);
+
+    puts("\n---------------------- Testing async access ----------------------");
+
+    debug_t f0Details = { "f0" };
+    debug_t f1Details = { "f1" };
+    debug_t f2Details = { "f2" };
+    page_t* f0 = pm_malloc(PAGE_SIZE, &f0Details);
+    pm_write(f0, 0, "async", 6, NULL);
+    page_t* f1 = pm_malloc(PAGE_SIZE, &f1Details);
+    pm_put(f1, 0, 'F', NULL);
+
+    puts("\n✗ pm_access_async f0 - invalid range");
+    pm_access_async(f0, 4, PAGE_SIZE, print_async, NULL);
+
+    // f1 is in memory, so the callback runs before pm_access_async returns.
+    puts("\n✔ pm_access_async f1 - in memory");
+    int f1Done = 0;
+    pm_access_async(f1, 0, 1, print_async, &f1Done);
+    printf("f1 done before return = %d\n", f1Done);
+
+    // f0 is on disk once f2 is written, so a worker brings it back and runs the callback.
+    puts("\n✔ pm_access_async f0 - on disk");
+    page_t* f2 = pm_malloc(PAGE_SIZE, &f2Details);
+    pm_put(f2, 0, 'F', NULL);
+    int f0Done = 0;
+    pm_access_async(f0, 0, 6, print_async, &f0Done);
+    while (!__atomic_load_n(&f0Done, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+    pm_print_heap();
+
+    puts("\n✔ pm_free f0, f1, f2");
+    pm_free(f0, NULL);
+    pm_free(f1, NULL);
+    pm_free(f2, NULL);
+
+    puts("\n-------------------- Testing batch malloc / free --------------------");
+
+    puts("\n✗ pm_malloc_batch - one size >1 page");
+    unsigned long sizes[] = { PAGE_SIZE, PAGE_SIZE + 1, PAGE_SIZE, PAGE_SIZE };
+    page_t* batch[4];
+    printf("allocated = %lu\n", pm_malloc_batch(2, sizes, batch));
+
+    // there are only 3 allocations, and none of them gets a page in memory until it is written.
+    puts("\n✔ pm_malloc_batch 4 - 3 allocated");
+    sizes[1] = PAGE_SIZE;
+    printf("allocated = %lu\n", pm_malloc_batch(4, sizes, batch));
+    pm_print_heap();
+    pm_print_allocations();
+
+    // the NULL pointer is skipped.
+    puts("\n✔ pm_free_batch 4 - 3 freed");
+    printf("freed = %lu\n", pm_free_batch(4, batch));
+    pm_print_allocations();
+
+    puts("\n------------------------ Testing statistics ------------------------");
+
+    // count from here on by taking the difference with the statistics so far.
+    pm_stats_t before, after;
+    pm_get_stats(&before);
+
+    page_t* g0 = pm_malloc(PAGE_SIZE, NULL);
+    pm_put(g0, 0, 'G', NULL);
+    page_t* g1 = pm_malloc(PAGE_SIZE, NULL);
+    pm_put(g1, 0, 'G', NULL);
+    page_t* g2 = pm_malloc(PAGE_SIZE, NULL);
+    pm_put(g2, 0, 'G', NULL);
+
+    puts("\n✗ pm_malloc g3 - heap is full");
+    pm_malloc(PAGE_SIZE, NULL);
+
+    // g0 was evicted for g2, so the first access faults it back in and the second finds it in memory.
+    pm_access(g0, 0, NULL);
+    pm_access(g0, 0, NULL);
+    pm_get_stats(&after);
+
+    puts("\n✔ pm_get_stats");
+    printf("accesses = %lu, hits = %lu, faults = %lu\n", after.accesses - before.accesses,
+        after.hits - before.hits, after.faults - before.faults);
+    printf("evictions = %lu (%lu clean, %lu dirty), alloc failures = %lu\n", after.evictions - before.evictions,
+        after.clean_evictions - before.clean_evictions, after.dirty_evictions - before.dirty_evictions,
+        after.alloc_failures - before.alloc_failures);
+    printf("disk reads = %lu (%lu B), disk writes = %lu (%lu B)\n", after.disk_reads - before.disk_reads,
+        after.bytes_read - before.bytes_read, after.disk_writes - before.disk_writes,
+        after.bytes_written - before.bytes_written);
+
+    pm_free(g0, NULL);
+    pm_free(g1, NULL);
+    pm_free(g2, NULL);
 
     pm_cleanup(false);
+
+    puts("\n------------------------ Testing dirty blocks ------------------------");
+
+    // 4 KiB pages are tracked in 8 blocks of 512 B, and one page in memory makes every access evict.
+    pm_config_t blocks_config = { .page_size = 4096, .heap_pages = 1, .disk_pages = 2 };
+    pm_init_config(&blocks_config);
+    page_t* k0 = pm_malloc(4096, NULL);
+    pm_memset(k0, 0, 'D', 4096, NULL);
+    page_t* k1 = pm_malloc(4096, NULL);
+    pm_put(k1, 0, 'K', NULL);
+    pm_access(k0, 0, NULL);
+
+    // only the block holding byte 1000 has changed since k0 was last written.
+    pm_get_stats(&before);
+    pm_put(k0, 1000, 'd', NULL);
+    pm_access(k1, 0, NULL);
+    pm_get_stats(&after);
+
+    puts("\n✔ evict k0 - 1 of 8 blocks written");
+    printf("disk writes = %lu (%lu B), skipped = %lu B\n", after.disk_writes - before.disk_writes,
+        after.bytes_written - before.bytes_written, after.bytes_skipped - before.bytes_skipped);
+    printf("k0[999] = %c, k0[1000] = %c, k0[4095] = %c\n", pm_access(k0, 999, NULL), pm_access(k0, 1000, NULL),
+        pm_access(k0, 4095, NULL));
+
+    pm_free(k0, NULL);
+    pm_free(k1, NULL);
+    pm_cleanup(false);
+
+    puts("\n------------------------ Testing zero pages ------------------------");
+
+    // one page in memory, which z0 and z1 take in turn.
+    pm_config_t zero_config = { .heap_pages = 1, .disk_pages = 2 };
+    pm_init_config(&zero_config);
+    pm_get_stats(&before);
+    page_t* z0 = pm_malloc(PAGE_SIZE, NULL);
+    page_t* z1 = pm_malloc(PAGE_SIZE, NULL);
+
+    puts("\n✔ pm_access z0 - never written, read without a page in memory");
+    printf("Value at index 0 = %d\n", pm_access(z0, 0, NULL));
+
+    // z1 is written to disk for z0, then z0 is dropped for z1 since it only holds '\0' again.
+    pm_put(z1, 0, 'Z', NULL);
+    pm_put(z0, 0, 'Z', NULL);
+    pm_put(z0, 0, '\0', NULL);
+    pm_access(z1, 0, NULL);
+
+    puts("\n✔ pm_access z0 - evicted holding only '\\0'");
+    printf("Value at index 0 = %d\n", pm_access(z0, 0, NULL));
+    pm_get_stats(&after);
+    printf("faults = %lu, disk reads = %lu, disk writes = %lu\n", after.faults - before.faults,
+        after.disk_reads - before.disk_reads, after.disk_writes - before.disk_writes);
+    printf("zero reads = %lu, zero evictions = %lu\n", after.zero_reads - before.zero_reads,
+        after.zero_evictions - before.zero_evictions);
+
+    pm_free(z0, NULL);
+    pm_free(z1, NULL);
+    pm_cleanup(false);
+
+    puts("\n------------------------ Testing trace ------------------------");
+
+    // one page in memory makes t0 and t1 fault each other out.
+    pm_config_t trace_config = { .heap_pages = 1, .disk_pages = 2 };
+    pm_init_config(&trace_config);
+    page_t* t0 = pm_malloc(PAGE_SIZE, NULL);
+    page_t* t1 = pm_malloc(PAGE_SIZE, NULL);
+    pm_put(t0, 0, 'T', NULL);
+    pm_put(t1, 0, 'T', NULL);
+    pm_access(t0, 0, NULL);
+    pm_free(t0, NULL);
+    pm_free(t1, NULL);
+
+    puts("\n✔ pm_trace_save - events by type");
+    pm_trace_save("pm_trace.bin");
+    FILE* trace_file = fopen("pm_trace.bin", "rb");
+    pm_trace_header_t trace_header;
+    pm_trace_event_t trace_event;
+    unsigned long type_counts[PM_TRACE_TYPES] = { 0 };
+    if (trace_file && fread(&trace_header, sizeof(trace_header), 1, trace_file) == 1) {
+        while (fread(&trace_event, sizeof(trace_event), 1, trace_file) == 1) {
+            type_counts[trace_event.type]++;
+        }
+    }
+    if (trace_file) {
+        fclose(trace_file);
+    }
+    remove("pm_trace.bin");
+    printf("malloc = %lu, free = %lu, access = %lu, put = %lu, fault = %lu, evict = %lu\n",
+        type_counts[PM_TRACE_MALLOC], type_counts[PM_TRACE_FREE], type_counts[PM_TRACE_ACCESS],
+        type_counts[PM_TRACE_PUT], type_counts[PM_TRACE_FAULT], type_counts[PM_TRACE_EVICT]);
+    pm_cleanup(false);
+
+    puts("\n------------------------ Testing objects ------------------------");
+
+    // 4 allocations of 4 KiB: a page of 16 B objects, a page of 32 B objects and a 6000 B object.
+    pm_config_t obj_config = { .page_size = 4096, .heap_pages = 2, .disk_pages = 2 };
+    pm_init_config(&obj_config);
+    pm_obj_t small[256];
+    pm_obj_t medium[128];
+    int made = 0;
+    for (int i = 0; i < 256; i++) {
+        small[i] = pm_obj_malloc(10);
+        made += small[i] != 0;
+    }
+    for (int i = 0; i < 128; i++) {
+        medium[i] = pm_obj_malloc(32);
+        made += medium[i] != 0;
+    }
+    printf("\n✔ pm_obj_malloc - %d small objects in 2 pages\n", made);
+
+    puts("\n✔ pm_obj_malloc - object of 2 pages");
+    pm_obj_t large = pm_obj_malloc(6000);
+    pm_obj_write(large, 4090, "spans", 6);
+    char spans[6] = "";
+    pm_obj_read(large, 4090, spans, 6);
+    printf("Value read = %s\n", spans);
+
+    puts("\n✗ pm_obj_malloc - no allocations left");
+    pm_obj_malloc(10);
+
+    puts("\n✔ pm_obj_read small[255] and medium[0]");
+    pm_obj_write(small[255], 0, "last", 5);
+    pm_obj_write(medium[0], 0, "first", 6);
+    char last[5] = "";
+    char first[6] = "";
+    pm_obj_read(small[255], 0, last, 5);
+    pm_obj_read(medium[0], 0, first, 6);
+    printf("Values read = %s, %s\n", last, first);
+
+    puts("\n✗ pm_obj_write - past the end of the object");
+    pm_obj_write(small[0], 10, "overflow", 9);
+
+    // the last page of a class is kept once its objects are freed, so it only takes objects of the class.
+    for (int i = 0; i < 128; i++) {
+        pm_obj_free(medium[i]);
+    }
+    puts("\n✔ pm_obj_malloc - 32 B object after freeing the 32 B objects, in the slot of medium[0]");
+    pm_obj_t reused = pm_obj_malloc(32);
+    char cleared[6] = "stale";
+    pm_obj_read(reused, 0, cleared, 6);
+    printf("handle = %s, value read = \"%s\"\n", reused ? "valid" : "0", cleared);
+
+    puts("\n✗ pm_obj_malloc - 64 B object after freeing the 32 B objects");
+    printf("handle = %s\n", pm_obj_malloc(64) ? "valid" : "0");
+
+    puts("\n✗ pm_obj_free - object already freed");
+    pm_obj_free(medium[1]);
+
+    puts("\n✗ pm_obj_write, pm_obj_read - objects already freed");
+    pm_obj_write(medium[1], 0, "stale", 6);
+    pm_obj_free(large);
+    pm_obj_read(large, 4090, spans, 6);
+    pm_cleanup(false);
+
+    puts("\n------------------------ Testing dedup ------------------------");
+
+    // one page in memory, which u0, u1 and u2 take in turn.
+    pm_config_t dedup_config = { .heap_pages = 1, .disk_pages = 3, .dedup = true };
+    pm_init_config(&dedup_config);
+    pm_get_stats(&before);
+    page_t* u0 = pm_malloc(PAGE_SIZE, NULL);
+    page_t* u1 = pm_malloc(PAGE_SIZE, NULL);
+    page_t* u2 = pm_malloc(PAGE_SIZE, NULL);
+
+    // u0 is written to disk for u1, and u1 and u2 are identical to it, so they share its slot.
+    pm_put(u0, 0, 'D', NULL);
+    pm_put(u1, 0, 'D', NULL);
+    pm_put(u2, 0, 'D', NULL);
+    pm_access(u0, 0, NULL);
+
+    // u1 changes while sharing the slot, so it gets one of its own when it is evicted.
+    pm_put(u1, 0, 'E', NULL);
+    pm_access(u0, 0, NULL);
+    pm_get_stats(&after);
+
+    puts("\n✔ pm_put - identical pages share a swap slot");
+    printf("disk writes = %lu, dedup hits = %lu, dedup copies = %lu\n", after.disk_writes - before.disk_writes,
+        after.dedup_hits - before.dedup_hits, after.dedup_copies - before.dedup_copies);
+
+    puts("\n✔ pm_access u0, u1, u2");
+    printf("Values at index 0 = %c %c %c\n", pm_access(u0, 0, NULL), pm_access(u1, 0, NULL), pm_access(u2, 0, NULL));
+
+    pm_free(u0, NULL);
+    pm_free(u1, NULL);
+    pm_free(u2, NULL);
+    pm_cleanup(false);
+
+    puts("\n------------------------ Testing readahead ------------------------");
+
+    // four pages in memory for 16 allocations, which are all written and then read in order.
+    pm_config_t ahead_config = { .heap_pages = 4, .disk_pages = 12, .readahead = 2 };
+    pm_init_config(&ahead_config);
+    page_t* ahead[16];
+    char ahead_values[17] = { 0 };
+    for (int i = 0; i < 16; i++) {
+        ahead[i] = pm_malloc(PAGE_SIZE, NULL);
+        pm_put(ahead[i], 0, 'A' + i, NULL);
+    }
+
+    puts("\n✔ pm_access ahead[0] to ahead[15] - in order");
+    pm_get_stats(&before);
+    for (int i = 0; i < 16; i++) {
+        ahead_values[i] = pm_access(ahead[i], 0, NULL);
+    }
+    pm_get_stats(&after);
+    printf("Values at index 0 = %s\n", ahead_values);
+    printf("faults = %lu, read ahead = %lu, read ahead hits = %lu\n", after.faults - before.faults,
+        after.readahead_pages - before.readahead_pages, after.readahead_hits - before.readahead_hits);
+
+    // the pages in memory are clean now, so a hint can take them.
+    puts("\n✔ pm_prefetch ahead[0] to ahead[3]");
+    pm_get_stats(&before);
+    printf("prefetched = %lu\n", pm_prefetch(4, ahead));
+    for (int i = 0; i < 4; i++) {
+        pm_access(ahead[i], 0, NULL);
+    }
+    pm_get_stats(&after);
+    printf("faults = %lu, read ahead hits = %lu\n", after.faults - before.faults,
+        after.readahead_hits - before.readahead_hits);
+
+    pm_free_batch(16, ahead);
+    pm_cleanup(false);
+
+    puts("\n------------------------ Testing batched eviction ------------------------");
+
+    // four pages in memory, evicted two at a time, for 8 allocations written in order.
+    pm_config_t batch_config = { .heap_pages = 4, .disk_pages = 4, .evict_batch = 2 };
+    pm_init_config(&batch_config);
+    page_t* victims[8];
+    pm_get_stats(&before);
+    for (int i = 0; i < 8; i++) {
+        victims[i] = pm_malloc(PAGE_SIZE, NULL);
+        pm_put(victims[i], 0, 'A' + i, NULL);
+    }
+    pm_get_stats(&after);
+
+    puts("\n✔ pm_put victims[0] to victims[7] - pages in consecutive slots written together");
+    printf("evictions = %lu, batch evictions = %lu, disk writes = %lu, write calls = %lu\n",
+        after.evictions - before.evictions, after.batch_evictions - before.batch_evictions,
+        after.disk_writes - before.disk_writes, after.write_calls - before.write_calls);
+
+    puts("\n✔ pm_access victims[0]");
+    printf("Value at index 0 = %c\n", pm_access(victims[0], 0, NULL));
+
+    pm_free_batch(8, victims);
+    pm_cleanup(false);
+
+    puts("\n------------------------ Testing persistence ------------------------");
+
+    // a persistent heap keeps its allocations across pm_cleanup(false) and the next pm_init_config.
+    pm_config_t config = { .persist = true };
+    pm_init_config(&config);
+    page_t* h0 = pm_malloc(PAGE_SIZE, NULL);
+    pm_write(h0, 0, "saved", 6, NULL);
+    unsigned int h0Idx = h0->alloc_idx;
+    pm_cleanup(false);
+
+    puts("\n✔ pm_attach h0 after restart");
+    pm_init_config(&config);
+    h0 = pm_attach(h0Idx);
+    char saved[6] = "";
+    pm_read(h0, 0, saved, 6, NULL);
+    printf("Value read = %s\n", saved);
+
+    puts("\n✗ pm_attach - allocation not in use");
+    printf("pointer = %p\n", (void*) pm_attach(h0Idx + 1));
+
+    puts("\n✗ pm_attach - out of range");
+    pm_attach(HEAP_PAGES + DISK_PAGES);
+
+    // removing the disk directory drops the saved heap.
+    puts("\n✔ pm_attach h0 after pm_cleanup(true)");
+    pm_cleanup(true);
+    pm_init_config(&config);
+    printf("pointer = %p\n", (void*) pm_attach(h0Idx));
+    pm_cleanup(true);
     return 0;
 }
\ No newline at end of file
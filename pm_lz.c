@@ -0,0 +1,212 @@
+/*
+*  pm_lz.c / Assignment: Practicum 1
+*
+*  James Florez and John Ciolfi / CS5600 / Northeastern University
+*  Spring 2023 / Mar 17, 2023
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "pm_lz.h"
+
+// the hash table of the compressor has 2^PM_LZ_HASH_BITS entries.
+#define PM_LZ_HASH_BITS 12
+// shortest match worth encoding.
+#define PM_LZ_MIN_MATCH 4
+// farthest back a match can be.
+#define PM_LZ_MAX_OFFSET 65535
+// no match starts in the last bytes of the input, and the last bytes are always literals.
+#define PM_LZ_MATCH_LIMIT 12
+#define PM_LZ_LAST_LITERALS 5
+
+/**
+ * Read 4 bytes at any alignment.
+ *
+ * @param p where to read.
+ * @return the 4 bytes.
+ */
+uint32_t pm_lz_read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * Write a length that didn't fit in its 4 bits of the token as a run of 255s and a final byte.
+ *
+ * @param dst the output buffer.
+ * @param cap the size of dst.
+ * @param op the position in dst, advanced past the length.
+ * @param len the length minus 15.
+ * @return true if the length fit in dst.
+ */
+bool pm_lz_write_length(unsigned char* dst, unsigned long cap, unsigned long* op, unsigned long len) {
+    while (len >= 255) {
+        if (*op >= cap) {
+            return false;
+        }
+        dst[(*op)++] = 255;
+        len -= 255;
+    }
+    if (*op >= cap) {
+        return false;
+    }
+    dst[(*op)++] = (unsigned char) len;
+    return true;
+}
+
+/**
+ * Write one sequence: literals followed by a match, or by nothing for the last sequence.
+ *
+ * @param dst the output buffer.
+ * @param cap the size of dst.
+ * @param op the position in dst, advanced past the sequence.
+ * @param lit the literals.
+ * @param lit_len the number of literals.
+ * @param offset how far back the match is.
+ * @param match_len the length of the match, or 0 for the last sequence.
+ * @return true if the sequence fit in dst.
+ */
+bool pm_lz_write_sequence(unsigned char* dst, unsigned long cap, unsigned long* op, const unsigned char* lit,
+        unsigned long lit_len, unsigned long offset, unsigned long match_len) {
+    if (*op >= cap) {
+        return false;
+    }
+    unsigned long match_code = match_len ? match_len - PM_LZ_MIN_MATCH : 0;
+    dst[(*op)++] = (unsigned char) ((lit_len < 15 ? lit_len : 15) << 4 | (match_code < 15 ? match_code : 15));
+
+    if (lit_len >= 15 && !pm_lz_write_length(dst, cap, op, lit_len - 15)) {
+        return false;
+    }
+    if (lit_len > cap - *op) {
+        return false;
+    }
+    memcpy(dst + *op, lit, lit_len);
+    *op += lit_len;
+
+    if (!match_len) {
+        return true;
+    }
+    if (cap - *op < 2) {
+        return false;
+    }
+    dst[(*op)++] = (unsigned char) (offset & 0xff);
+    dst[(*op)++] = (unsigned char) (offset >> 8);
+    return match_code < 15 || pm_lz_write_length(dst, cap, op, match_code - 15);
+}
+
+unsigned long pm_lz_compress(const char* src, unsigned long len, char* dst, unsigned long cap) {
+    const unsigned char* in = (const unsigned char*) src;
+    unsigned char* out = (unsigned char*) dst;
+    unsigned long ip = 0;
+    unsigned long anchor = 0;
+    unsigned long op = 0;
+
+    // positions + 1 of the last 4 bytes seen with each hash, 0 if none.
+    uint32_t table[1 << PM_LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    if (len > PM_LZ_MATCH_LIMIT) {
+        unsigned long limit = len - PM_LZ_MATCH_LIMIT;
+        while (ip < limit) {
+            uint32_t seq = pm_lz_read32(in + ip);
+            uint32_t hash = (seq * 2654435761u) >> (32 - PM_LZ_HASH_BITS);
+            unsigned long ref = table[hash];
+            table[hash] = (uint32_t) (ip + 1);
+
+            if (ref == 0 || ip - (ref - 1) > PM_LZ_MAX_OFFSET || pm_lz_read32(in + ref - 1) != seq) {
+                ip++;
+                continue;
+            }
+            ref--;
+
+            // extend the match as far as it goes, leaving the last bytes as literals.
+            unsigned long match_len = PM_LZ_MIN_MATCH;
+            while (ip + match_len < len - PM_LZ_LAST_LITERALS && in[ip + match_len] == in[ref + match_len]) {
+                match_len++;
+            }
+
+            if (!pm_lz_write_sequence(out, cap, &op, in + anchor, ip - anchor, ip - ref, match_len)) {
+                return 0;
+            }
+            ip += match_len;
+            anchor = ip;
+        }
+    }
+
+    // the rest of the input is literals.
+    if (!pm_lz_write_sequence(out, cap, &op, in + anchor, len - anchor, 0, 0)) {
+        return 0;
+    }
+    return op;
+}
+
+/**
+ * Read a length that didn't fit in its 4 bits of the token.
+ *
+ * @param src the compressed bytes.
+ * @param clen the number of compressed bytes.
+ * @param ip the position in src, advanced past the length.
+ * @param len the length so far, increased by what was read.
+ * @return true if the length was complete, false if src ended first.
+ */
+bool pm_lz_read_length(const unsigned char* src, unsigned long clen, unsigned long* ip, unsigned long* len) {
+    unsigned char b;
+    do {
+        if (*ip >= clen) {
+            return false;
+        }
+        b = src[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+bool pm_lz_decompress(const char* src, unsigned long clen, char* dst, unsigned long len) {
+    const unsigned char* in = (const unsigned char*) src;
+    unsigned char* out = (unsigned char*) dst;
+    unsigned long ip = 0;
+    unsigned long op = 0;
+
+    while (ip < clen) {
+        unsigned char token = in[ip++];
+
+        // literals.
+        unsigned long lit_len = token >> 4;
+        if (lit_len == 15 && !pm_lz_read_length(in, clen, &ip, &lit_len)) {
+            return false;
+        }
+        if (lit_len > clen - ip || lit_len > len - op) {
+            return false;
+        }
+        memcpy(out + op, in + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // the last sequence has no match.
+        if (ip == clen) {
+            break;
+        }
+
+        // match, which may overlap the bytes it produces, so it is copied a byte at a time.
+        if (clen - ip < 2) {
+            return false;
+        }
+        unsigned long offset = in[ip] | (unsigned long) in[ip + 1] << 8;
+        ip += 2;
+        unsigned long match_len = token & 15;
+        if (match_len == 15 && !pm_lz_read_length(in, clen, &ip, &match_len)) {
+            return false;
+        }
+        match_len += PM_LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || match_len > len - op) {
+            return false;
+        }
+        for (unsigned long i = 0; i < match_len; i++) {
+            out[op + i] = out[op - offset + i];
+        }
+        op += match_len;
+    }
+
+    return op == len;
+}
@@ -0,0 +1,36 @@
+/*
+*  pm_lz.h / Assignment: Practicum 1
+*
+*  James Florez and John Ciolfi / CS5600 / Northeastern University
+*  Spring 2023 / Mar 17, 2023
+*/
+
+#ifndef PM_LZ_H
+#define PM_LZ_H
+
+#include <stdbool.h>
+
+/**
+ * Compress a buffer with a small LZ77 codec in the LZ4 block format: each sequence is a token
+ * (literal count, match length), the literals, and a 16-bit offset back to the match.
+ *
+ * @param src the bytes to compress.
+ * @param len the number of bytes to compress.
+ * @param dst where to write the compressed bytes.
+ * @param cap the most bytes that can be written to dst.
+ * @return the number of compressed bytes, or 0 if they don't fit in cap.
+ */
+unsigned long pm_lz_compress(const char* src, unsigned long len, char* dst, unsigned long cap);
+
+/**
+ * Decompress a buffer written by pm_lz_compress.
+ *
+ * @param src the compressed bytes.
+ * @param clen the number of compressed bytes.
+ * @param dst where to write the original bytes.
+ * @param len the number of original bytes.
+ * @return true if exactly len bytes were decompressed, false if src is corrupt.
+ */
+bool pm_lz_decompress(const char* src, unsigned long clen, char* dst, unsigned long len);
+
+#endif
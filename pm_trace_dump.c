@@ -0,0 +1,96 @@
+/*
+*  pm_trace_dump.c / Assignment: Practicum 1
+*
+*  James Florez and John Ciolfi / CS5600 / Northeastern University
+*  Spring 2023 / Mar 17, 2023
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pm_heap.h"
+
+// names of the trace event types, indexed by pm_trace_type_t.
+static const char* type_names[PM_TRACE_TYPES] = {
+    "malloc", "free", "access", "put", "fault", "evict", "lock_wait"
+};
+
+/**
+ * Order trace events by the time they started, then by thread.
+ *
+ * @param a the first event.
+ * @param b the second event.
+ * @return negative, zero or positive as a starts before, with or after b.
+ */
+int pm_trace_compare(const void* a, const void* b) {
+    const pm_trace_event_t* x = a;
+    const pm_trace_event_t* y = b;
+    if (x->time_ns != y->time_ns) {
+        return x->time_ns < y->time_ns ? -1 : 1;
+    }
+    return (int) x->thread - (int) y->thread;
+}
+
+/**
+ * Print the events of a file saved by pm_trace_save, merged across threads in time order.
+ * Usage: ./pm_trace_dump <trace file> [minimum duration in ns]
+ */
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        printf("Usage: %s <trace file> [minimum duration in ns]\n", argv[0]);
+        return 1;
+    }
+    unsigned long min_duration = argc == 3 ? strtoul(argv[2], NULL, 10) : 0;
+
+    FILE* file = fopen(argv[1], "rb");
+    if (!file) {
+        printf("Error: couldn't open %s.\n", argv[1]);
+        return 1;
+    }
+
+    pm_trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, PM_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        printf("Error: %s is not a pm_heap trace.\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+    if (header.event_size != sizeof(pm_trace_event_t)) {
+        printf("Error: %s has %u B events, expected %zu B.\n", argv[1], header.event_size, sizeof(pm_trace_event_t));
+        fclose(file);
+        return 1;
+    }
+
+    pm_trace_event_t* events = malloc((header.events ? header.events : 1) * sizeof(pm_trace_event_t));
+    if (!events || fread(events, sizeof(pm_trace_event_t), header.events, file) != header.events) {
+        printf("Error: %s is truncated.\n", argv[1]);
+        free(events);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+
+    // each thread's events are in order already, but threads interleave.
+    qsort(events, header.events, sizeof(pm_trace_event_t), pm_trace_compare);
+
+    printf("# %lu events, %u shards, page size = %lu B\n",
+        (unsigned long) header.events, header.shards, (unsigned long) header.page_size);
+    printf("# time_ns thread type alloc arg duration_ns flags\n");
+    for (unsigned long i = 0; i < header.events; i++) {
+        pm_trace_event_t* event = &events[i];
+        if (event->duration_ns < min_duration) {
+            continue;
+        }
+        printf("%lu %u %s %d %d %u%s%s%s%s\n",
+            (unsigned long) event->time_ns, event->thread,
+            event->type < PM_TRACE_TYPES ? type_names[event->type] : "unknown",
+            event->alloc_idx, event->arg, event->duration_ns,
+            event->flags & PM_TRACE_LOCKLESS ? " lockless" : "",
+            event->flags & PM_TRACE_POOL ? " pool" : "",
+            event->flags & PM_TRACE_DIRTY ? " dirty" : "",
+            event->flags & PM_TRACE_READAHEAD ? " readahead" : "");
+    }
+
+    free(events);
+    return 0;
+}
\ No newline at end of file